@@ -14,27 +14,75 @@
 #include <cmsis_os.h>
 #include <usbh_core.h>
 
+#include "settings.h"
+
 typedef struct {
 	bool written;
+	uint16_t offset;			/* Where the chunk being written starts in the OUT data. */
+	bool zlpPending;			/* A zero length packet must follow the last chunk. */
+	uint8_t nNaks;				/* NAKs of the chunk being written in a row. */
+	bool backingOff;			/* Waits for retryTimer before writing the chunk again. */
+	uint32_t retryTimer;		/* The host timer at which the chunk gets written again. */
 } DX_ActiveServoClass_WritingState_t;
 
 typedef struct {
 	bool reading;
 } DX_ActiveServoClass_ReadingState_t;
 
+typedef enum {
+	DX__ACTIVE_SERVO_CLASS__ERROR_STEP__CLEAR_OUT = 0,
+	DX__ACTIVE_SERVO_CLASS__ERROR_STEP__CLEAR_IN,
+	DX__ACTIVE_SERVO_CLASS__ERROR_STEP__DONE,
+} DX_ActiveServoClass_ErrorStep_TypeDef;
+
+/// Recovery of the bulk end-points, one CLEAR_FEATURE(ENDPOINT_HALT) request at a time.
 typedef struct {
-	uint8_t *out;
-	uint8_t *in;
-} DX_ActiveServoClass_Cmd_TypeDef;
+	uint8_t step;				/* See DX_ActiveServoClass_ErrorStep_TypeDef. */
+} DX_ActiveServoClass_ErrorState_t;
+
+/// Polling of the interrupt IN end-point the servo reports telemetry on.
+typedef struct {
+	bool reading;
+	uint32_t lastPollTimer;		/* The host timer at the time the last poll got started. */
+	volatile bool pollDue;		/* The SOF interrupt woke the USB host thread for the next poll. */
+} DX_ActiveServoClass_TelemetryState_t;
 
 typedef enum {
 	DX__ACTIVE_SERVO_CLASS__OK = 0, DX__ACTIVE_SERVO_CLASS__ERR,
 } DX_ActiveServoClass_StatusTypeDef;
 
+/// The timestamps are the ones of dx/eth2usb/timestamp.h, DX__ETH2USB__TIMESTAMP__NONE for
+///  stages the command didn't go through, and for all of them if it failed.
 typedef struct {
 	DX_ActiveServoClass_StatusTypeDef status;
+	uint16_t inLength;			/* The number of bytes actually read. */
+	uint32_t outSubmittedTimestamp;	/* The first OUT transfer got started. */
+	uint32_t outDoneTimestamp;	/* The last OUT transfer completed. */
+	uint32_t inDoneTimestamp;	/* The IN transfer completed. */
 } DX_ActiveServoClass_Rsp_TypeDef;
 
+/// Gets called from the USB host thread once a submitted command completed.
+typedef void (*DX_ActiveServoClass_CompletionCallback_TypeDef)(void *arg,
+		const DX_ActiveServoClass_Rsp_TypeDef *rsp);
+
+/// Gets called from the USB host thread for every telemetry report of the servo, the report
+///  is only valid during the call.
+typedef void (*DX_ActiveServoClass_TelemetryCallback_TypeDef)(void *arg,
+		const uint8_t *report, uint16_t length);
+
+/// Gets called from the USB host thread once an attached device can take commands.
+typedef void (*DX_ActiveServoClass_ReadyCallback_TypeDef)(void *arg);
+
+typedef struct {
+	uint8_t *out;
+	uint16_t outLength;
+	uint8_t *in;
+	uint16_t inLength;			/* The size of the in buffer, NULL in means nothing is read. */
+	DX_ActiveServoClass_CompletionCallback_TypeDef callback;
+	void *arg;					/* Passed to the callback as is. */
+	uint16_t timeout;			/* In frames, zero for DX_ETH2USB__ACTIVE_SERVO_CLASS__CMD_TIMEOUT. */
+} DX_ActiveServoClass_Cmd_TypeDef;
+
 typedef enum {
 	DX__ETH2USB__ACTIVE_SERVO_CLASS_STATE__IDLE = 0,
 	DX__ETH2USB__ACTIVE_SERVO_CLASS_STATE__WRITING,
@@ -52,9 +100,14 @@ typedef struct {
 	// Pipe numbers.
 	uint8_t inPipeNo;
 	uint8_t outPipeNo;
+	// Telemetry, the pipe number is zero if the servo has no interrupt IN end-point.
+	uint8_t intEpAddr;
+	uint16_t intEpMaxPktSize;
+	uint8_t intPipeNo;
+	uint16_t intPollInterval;	/* In frames. */
 	// Mutexes.
 	osMutexId_t availabilityMutexId;
-	// Message queues.
+	// Message queues, the command one is the submission ring.
 	osMessageQueueId_t cmdMsgQueueId;
 	osMessageQueueId_t rspMsgQueueId;
 	// State.
@@ -62,15 +115,94 @@ typedef struct {
 	DX_ActiveServoClass_State_TypeDef state;
 	DX_ActiveServoClass_State_TypeDef nextState;
 	DX_ActiveServoClass_Cmd_TypeDef cmd;
+	// Pre-arming, see DX_ETH2USB__ACTIVE_SERVO_CLASS__PREARM_IN.
+	DX_ActiveServoClass_Cmd_TypeDef nextCmd;
+	bool hasNextCmd;			/* The OUT transfer of nextCmd has been started already. */
+	bool inPrearmed;			/* The IN transfer of cmd has been started already. */
+	// Deadline of the current command, or of the recovery in the error state.
+	uint32_t deadline;
+	// Timestamps of the current command and of the pre-sent next one, see DX_ActiveServoClass_Rsp_TypeDef.
+	uint32_t outSubmittedTimestamp;
+	uint32_t outDoneTimestamp;
+	uint32_t nextOutSubmittedTimestamp;
+	// Wake-up of the USB host thread from the SOF interrupt, see DX_USB_ActiveServoClass_WakeAt.
+	volatile bool wakeArmed;
+	volatile uint32_t wakeTimer;
 	// States.
 	DX_ActiveServoClass_WritingState_t writingState;
 	DX_ActiveServoClass_ReadingState_t readingState;
+	DX_ActiveServoClass_ErrorState_t errorState;
+	DX_ActiveServoClass_TelemetryState_t telemetryState;
 } DX_ActiveServoClass_HandleTypeDef;
 
+/**
+ * Submits a command without waiting for it, the callback of the command gets called
+ *  once it completed. Up to DX_ETH2USB__ACTIVE_SERVO_CLASS__SUBMISSION_RING_SIZE
+ *  commands can be outstanding, beyond that this blocks until one got picked up, for
+ *  DX_ETH2USB__ACTIVE_SERVO_CLASS__SUBMIT_TIMEOUT at most. Fails without calling the
+ *  callback if the device isn't attached, a submitted command always completes.
+ */
+DX_ActiveServoClass_StatusTypeDef DX_ActiveServoClass_Submit(
+		USBH_HandleTypeDef *phost, const DX_ActiveServoClass_Cmd_TypeDef *cmd);
+
+/**
+ * Executes a command, and waits for it to complete. That takes no longer than
+ *  DX_ETH2USB__ACTIVE_SERVO_CLASS__CMD_TIMEOUT frames once the command got picked up.
+ */
 DX_ActiveServoClass_StatusTypeDef DX_ActiveServoClass_Cmd(
-		USBH_HandleTypeDef *phost, uint8_t *out, uint8_t *in);
+		USBH_HandleTypeDef *phost, uint8_t *out, uint16_t outLength, uint8_t *in,
+		uint16_t inLength, uint16_t *inLengthRead);
+
+/**
+ * Sets the callback that gets the telemetry reports of the given device, NULL to drop them.
+ *  The callback survives the device being removed and attached again, so it can be set
+ *  before the device shows up.
+ */
+void DX_ActiveServoClass_SetTelemetryCallback(uint8_t deviceNo,
+		DX_ActiveServoClass_TelemetryCallback_TypeDef callback, void *arg);
+
+/**
+ * Sets the callback that gets called whenever the given device got attached and can take
+ *  commands, NULL for none. Like the telemetry one it survives the device being removed.
+ */
+void DX_ActiveServoClass_SetReadyCallback(uint8_t deviceNo,
+		DX_ActiveServoClass_ReadyCallback_TypeDef callback, void *arg);
+
+/**
+ * Completes the current command of the state machine, only for use by the states.
+ */
+void DX_USB_ActiveServoClass_CompleteCmd(USBH_HandleTypeDef *phost,
+		DX_ActiveServoClass_StatusTypeDef status, uint16_t inLength);
+
+/**
+ * Wakes the USB host thread once the host timer reached the given one, only for use by
+ *  the states. Of several wake-ups requested, the earliest one wins.
+ */
+void DX_USB_ActiveServoClass_WakeAt(USBH_HandleTypeDef *phost, uint32_t timer);
+
+/**
+ * Gets the buffer the OTG DMA sends the given OUT data from, only for use by the states.
+ *  Without DX_ETH2USB__USB__DMA, or when usable as is, that's the given one.
+ */
+uint8_t* DX_USB_ActiveServoClass_DmaOut(USBH_HandleTypeDef *phost, uint8_t *out,
+		uint16_t length);
+
+/**
+ * Gets the buffer the OTG DMA receives the IN data of the command into and the length to
+ *  request, only for use by the states. DX_USB_ActiveServoClass_DmaInDone must follow once
+ *  the transfer completed.
+ */
+uint8_t* DX_USB_ActiveServoClass_DmaIn(USBH_HandleTypeDef *phost,
+		const DX_ActiveServoClass_Cmd_TypeDef *cmd, uint16_t *length);
+
+/**
+ * Makes the received IN data visible in the command's buffer, only for use by the states.
+ *  Returns the number of bytes of it that fit the command's buffer.
+ */
+uint16_t DX_USB_ActiveServoClass_DmaInDone(USBH_HandleTypeDef *phost,
+		const DX_ActiveServoClass_Cmd_TypeDef *cmd, uint16_t inLength);
 
-extern USBH_ClassTypeDef gDxActiveServoClass;
-#define DX_ACTIVE_SERVO_CLASS &gDxActiveServoClass
+extern USBH_ClassTypeDef gDxActiveServoClass[DX_ETH2USB__USB__MAX_DEVICE_CNT];
+#define DX_ACTIVE_SERVO_CLASS(deviceNo) (&gDxActiveServoClass[(deviceNo)])
 
 #endif /* INC_DX_ETH2USB_ACTIVE_SERVO_CLASS_H_ */
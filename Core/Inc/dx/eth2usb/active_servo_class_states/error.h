@@ -0,0 +1,18 @@
+/*
+ * error.h
+ *
+ *  Created on: Oct 17, 2026
+ */
+
+#ifndef INC_DX_ETH2USB_ACTIVE_SERVO_CLASS_STATES_ERROR_H_
+#define INC_DX_ETH2USB_ACTIVE_SERVO_CLASS_STATES_ERROR_H_
+
+#include <usbh_core.h>
+
+USBH_StatusTypeDef DX_USB_ActiveServoClass_ErrorState_Entry(USBH_HandleTypeDef *phost);
+
+USBH_StatusTypeDef DX_USB_ActiveServoClass_ErrorState_Do(USBH_HandleTypeDef *phost);
+
+USBH_StatusTypeDef DX_USB_ActiveServoClass_ErrorState_Exit(USBH_HandleTypeDef *phost);
+
+#endif /* INC_DX_ETH2USB_ACTIVE_SERVO_CLASS_STATES_ERROR_H_ */
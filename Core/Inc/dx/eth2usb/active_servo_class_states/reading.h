@@ -10,6 +10,8 @@
 
 #include <usbh_core.h>
 
+USBH_StatusTypeDef DX_USB_ActiveServoClass_ReadingState_Arm(USBH_HandleTypeDef *phost);
+
 USBH_StatusTypeDef DX_USB_ActiveServoClass_ReadingState_Entry(USBH_HandleTypeDef *phost);
 
 USBH_StatusTypeDef DX_USB_ActiveServoClass_ReadingState_Do(USBH_HandleTypeDef *phost);
@@ -10,6 +10,11 @@
 
 #include <usbh_core.h>
 
+#include "dx/eth2usb/active_servo_class.h"
+
+USBH_StatusTypeDef DX_USB_ActiveServoClass_WritingState_Send(USBH_HandleTypeDef *phost,
+		DX_ActiveServoClass_Cmd_TypeDef *cmd, uint16_t offset);
+
 USBH_StatusTypeDef DX_USB_ActiveServoClass_WritingState_Entry(USBH_HandleTypeDef *phost);
 
 USBH_StatusTypeDef DX_USB_ActiveServoClass_WritingState_Do(USBH_HandleTypeDef *phost);
@@ -11,34 +11,174 @@
 #include <assert.h>
 #include <stdbool.h>
 #include <cmsis_os.h>
-#include <sys/socket.h>
+#include <lwip/api.h>
 
+#include "dx/eth2usb/attach.h"
+#include "dx/eth2usb/cache.h"
 #include "dx/eth2usb/command.h"
+#include "dx/eth2usb/hello.h"
+#include "dx/eth2usb/latency.h"
+#include "dx/eth2usb/poll.h"
 #include "dx/eth2usb/response.h"
+#include "dx/eth2usb/ring.h"
+#include "dx/eth2usb/telemetry.h"
 #include "settings.h"
 
+/// Set by the netconn callback whenever one of our connections has an event.
+#define DX_ETH2USB__APP__ETH_THREAD_FLAG__NETCONN 0x00000001U
+/// Set by the USB thread whenever it finished a command.
+#define DX_ETH2USB__APP__ETH_THREAD_FLAG__USB 0x00000002U
+/// Set by the telemetry callback whenever a servo reported.
+#define DX_ETH2USB__APP__ETH_THREAD_FLAG__TELEMETRY 0x00000004U
+
+/// Set by the Ethernet thread whenever it queued a command.
+#define DX_ETH2USB__APP__USB_THREAD_FLAG__COMMAND 0x00000001U
+/// Set by the completion callback whenever a submitted command completed.
+#define DX_ETH2USB__APP__USB_THREAD_FLAG__COMPLETION 0x00000002U
+/// Set by the ready callback whenever a device got attached and can take commands.
+#define DX_ETH2USB__APP__USB_THREAD_FLAG__DEVICE 0x00000004U
+
+/// The session number used for commands that arrived over UDP.
+#define DX_ETH2USB__APP__UDP_SESSION_NO 0xFFU
+
+/// Where a command came from, and thus where its response must go to.
+typedef struct {
+	uint8_t sessionNo;			/* The TCP session, or DX_ETH2USB__APP__UDP_SESSION_NO. */
+	uint32_t epoch;				/* TCP only: the epoch of the session when the command got read. */
+	uint32_t seqNo;				/* UDP only: the sequence number of the datagram. */
+	ip_addr_t addr;				/* UDP only: the address of the peer. */
+	uint16_t port;				/* UDP only: the port of the peer. */
+} DX_ETH2USB_App_Origin_t;
+
+typedef struct DX_ETH2USB_App_Response DX_ETH2USB_App_Response_t;
+
+/// A command as it travels from the Ethernet thread to the USB thread, version 1
+///  frames get converted to version 2 ones.
+typedef struct {
+	DX_ETH2USB_App_Origin_t origin;
+	DX_ETH2USB_App_Response_t *response;	/* USB thread only: the response being produced, NULL if write only. */
+	uint16_t length;			/* The payload length in host byte order. */
+	uint16_t maxResponseLength;	/* The number of bytes to read from the servo in host byte order. */
+	uint8_t *payload;			/* Points at the payload of the frame. */
+	uint32_t cacheGeneration;	/* USB thread only: the cache generation of the device when the command got started. */
+	DX_ETH2USB_Latency_Stamps_t stamps;
+	DX_ETH2USB_CommandV2_t frame;
+} DX_ETH2USB_App_Command_t;
+
+/// A response as it travels from the USB thread to the Ethernet thread, version 1
+///  sessions only get the payload.
+struct DX_ETH2USB_App_Response {
+	DX_ETH2USB_App_Origin_t origin;
+	DX_ETH2USB_Latency_Stamps_t stamps;	/* Those of the command, none for telemetry. */
+	DX_ETH2USB_ResponseV2_t frame;
+};
+
+/// A telemetry report as it travels from the USB host thread to the Ethernet thread.
+typedef struct {
+	uint8_t deviceNo;
+	uint16_t length;
+	uint8_t payload[DX_ETH2USB__MAX_PACKET_SIZE];
+} DX_ETH2USB_App_Telemetry_t;
+
 typedef struct {
-	int32_t fd;
-	struct sockaddr_in addr;
+	struct netconn *conn;
+	uint16_t port;
+	// The version its sessions speak, zero if they start with a hello.
+	uint8_t version;
 } DX_ETH2USB_App_EthThread_ServerState_t;
 
+/// The responses that are waiting to be written to a single session.
 typedef struct {
-	int32_t fd;
-	struct sockaddr_in addr;
-	socklen_t socklen;
-	bool connected;
-} DX_ETH2USB_App_EthThread_ClientState_t;
+	DX_ETH2USB_App_Response_t *responses[DX_ETH2USB__APP__RESPONSE_MEM_POOL_SIZE];
+	uint8_t head;
+	uint8_t count;
+	uint32_t firstTimestamp;	/* When the queue stopped being empty, for coalescing. */
+} DX_ETH2USB_App_EthThread_ResponseQueue_t;
 
+/// A response that has been handed to lwIP without copying it, it must be kept until
+///  the client acknowledged it.
 typedef struct {
-	// Sockets.
-	DX_ETH2USB_App_EthThread_ServerState_t server;
-	DX_ETH2USB_App_EthThread_ClientState_t client;
+	DX_ETH2USB_App_Response_t *response;
+	uint32_t endSeqNo;			/* The TCP sequence number following its last byte. */
+} DX_ETH2USB_App_EthThread_UnackedResponse_t;
+
+/// The responses that have been written to a single session, in the order they were.
+typedef struct {
+	DX_ETH2USB_App_EthThread_UnackedResponse_t responses[DX_ETH2USB__APP__RESPONSE_MEM_POOL_SIZE];
+	uint8_t head;
+	uint8_t count;
+} DX_ETH2USB_App_EthThread_UnackedQueue_t;
+
+typedef struct {
+	struct netconn *conn;
+	// Advanced whenever the session gets closed, work tagged with an older one is stale.
+	volatile uint32_t epoch;
+	// Set once the session stops reading, it gets closed when all responses are acknowledged.
+	bool closing;
+	// Received data that has not yet been copied into a command.
+	struct pbuf *pbuf;
+	uint16_t pbufOffset;
+	// Protocol negotiation, version is zero until the hello has been read.
+	uint8_t version;
+	DX_ETH2USB_Hello_t hello;
+	bool helloPending;
 	// Frames.
-	DX_ETH2USB_Command_t *command;
-	DX_ETH2USB_Response_t *response;
-	// Frame writing.
+	DX_ETH2USB_App_Command_t *command;
+	DX_ETH2USB_App_EthThread_ResponseQueue_t responseQueue;
+	DX_ETH2USB_App_EthThread_UnackedQueue_t unackedQueue;
+	// Response slots the session holds or will, see DX_ETH2USB__APP__MAX_SESSION_RESPONSE_CNT.
+	uint8_t nResponseSlots;
+	// Frame writing, responses are written from the head of the response queue.
 	uint32_t nBytesWritten;
 	uint32_t nBytesRead;
+	// Bit n is set if the session gets the telemetry of device n.
+	uint8_t telemetryMask;
+} DX_ETH2USB_App_EthThread_SessionState_t;
+
+typedef struct {
+	ip_addr_t addr;
+	uint16_t port;
+	uint32_t lastSeqNo;
+	bool seqNoKnown;			/* The peer sent a command already, so lastSeqNo is valid. */
+	uint32_t lastSeenTick;
+	bool used;
+	uint8_t telemetryMask;		/* Bit n is set if the peer gets the telemetry of device n. */
+	uint32_t telemetrySeqNo;	/* The sequence number of the next telemetry datagram. */
+} DX_ETH2USB_App_EthThread_UdpPeer_t;
+
+typedef struct {
+	uint32_t nReceived;
+	uint32_t nSent;
+	uint32_t nDroppedMalformed;		/* Datagrams with the wrong size. */
+	uint32_t nDroppedNoSlot;		/* Datagrams received while the command pool was empty. */
+	uint32_t nDroppedStale;			/* Reordered or duplicated datagrams. */
+	uint32_t nLost;					/* Gaps in the sequence numbers of a peer. */
+	uint32_t nDroppedResponses;		/* Responses that could not be sent. */
+	uint32_t nDroppedTelemetry;		/* Telemetry datagrams that could not be sent. */
+} DX_ETH2USB_App_EthThread_UdpCounters_t;
+
+typedef struct {
+	struct netconn *conn;
+	uint16_t port;
+	DX_ETH2USB_App_EthThread_UdpPeer_t peers[DX_ETH2USB__APP__MAX_UDP_PEER_CNT];
+	DX_ETH2USB_App_EthThread_UdpCounters_t counters;
+} DX_ETH2USB_App_EthThread_UdpState_t;
+
+typedef struct {
+	uint32_t nReceived;
+	uint32_t nDroppedQueueFull;		/* Reports the Ethernet thread didn't pick up in time. */
+	uint32_t nDroppedNoSlot;		/* Reports that didn't get to a session for lack of response slots. */
+} DX_ETH2USB_App_EthThread_TelemetryCounters_t;
+
+typedef struct {
+	// Sockets.
+	DX_ETH2USB_App_EthThread_ServerState_t server;
+	DX_ETH2USB_App_EthThread_ServerState_t helloServer;
+	DX_ETH2USB_App_EthThread_UdpState_t udp;
+	DX_ETH2USB_App_EthThread_SessionState_t sessions[DX_ETH2USB__APP__MAX_SESSION_CNT];
+	uint8_t nConnectedSessions;
+	// Telemetry, nReceived and nDroppedQueueFull get written by the USB host thread.
+	DX_ETH2USB_App_EthThread_TelemetryCounters_t telemetryCounters;
 } DX_ETH2USB_App_EthThreadState_t;
 
 typedef struct {
@@ -48,18 +188,95 @@ typedef struct {
 	bool wasUsbConnected;
 } DX_ETH2USB_App_StatusThreadState_t;
 
+/// The commands for a single device, those that wait for room in its submission ring
+///  are kept in order.
+typedef struct {
+	DX_ETH2USB_App_Command_t *pending[DX_ETH2USB__APP__COMMAND_MEM_POOL_SIZE];
+	uint8_t head;
+	uint8_t count;
+	uint8_t nSubmitted;			/* Servo commands submitted to the class that didn't complete yet. */
+	// Advanced whenever the cached responses of the device get dropped, a response read
+	//  before that doesn't get cached anymore.
+	uint32_t cacheGeneration;
+	uint32_t connectionNo;		/* The connection of the device the cached responses are of. */
+	// The connection of the device a command got served on first, and how long after the
+	//  device got plugged in that happened.
+	uint32_t servedConnectionNo;
+	uint32_t plugToFirstCommandMs;
+} DX_ETH2USB_App_UsbThread_DeviceState_t;
+
+/// A cached response to an idempotent command, the command payload is the key.
+typedef struct {
+	bool valid;
+	uint8_t deviceNo;
+	uint16_t length;
+	uint16_t maxResponseLength;
+	uint8_t command[DX_ETH2USB__MAX_PACKET_SIZE];
+	uint32_t expiryTick;
+	uint32_t lastUsedTick;
+	uint16_t responseLength;
+	uint8_t response[DX_ETH2USB__MAX_PACKET_SIZE];
+} DX_ETH2USB_App_UsbThread_CacheEntry_t;
+
+typedef struct {
+	DX_ETH2USB_App_UsbThread_CacheEntry_t entries[DX_ETH2USB__APP__RESPONSE_CACHE_ENTRY_CNT];
+	uint32_t nHits;
+	uint32_t nMisses;
+	uint32_t nInvalidations;
+} DX_ETH2USB_App_UsbThread_Cache_t;
+
+/// An entry of the status table, its servo command gets sent every interval and the latest
+///  result kept for the clients to read.
+typedef struct {
+	// Configuration, an interval of zero means the entry is unused.
+	uint8_t deviceNo;
+	uint16_t intervalMs;
+	uint16_t length;
+	uint16_t maxResponseLength;
+	uint8_t command[DX__ETH2USB__POLL__MAX_COMMAND_SIZE];
+	uint32_t generation;		/* Advanced whenever the entry gets configured. */
+	// Polling, the buffers belong to the servo while the poll is in flight.
+	uint32_t nextTick;
+	bool inFlight;
+	uint8_t submittedDeviceNo;
+	uint32_t submittedGeneration;
+	uint8_t out[DX__ETH2USB__POLL__MAX_COMMAND_SIZE];
+	uint8_t in[DX__ETH2USB__POLL__MAX_RESULT_SIZE];
+	// Latest result.
+	uint8_t status;
+	uint16_t resultLength;
+	uint32_t timestamp;
+	uint32_t nUpdates;
+	uint8_t result[DX__ETH2USB__POLL__MAX_RESULT_SIZE];
+} DX_ETH2USB_App_UsbThread_PollEntry_t;
+
+/// A completed poll as it travels from the USB host thread to the USB thread.
+typedef struct {
+	uint8_t entryNo;
+	uint8_t status;				/* See DX__ETH2USB__RESPONSE_STATUS__*. */
+	uint16_t inLength;
+} DX_ETH2USB_App_PollCompletion_t;
+
 typedef struct {
-	DX_ETH2USB_Command_t *command;
-	DX_ETH2USB_Response_t *response;
+	DX_ETH2USB_App_UsbThread_DeviceState_t devices[DX_ETH2USB__USB__MAX_DEVICE_CNT];
+	DX_ETH2USB_App_UsbThread_PollEntry_t pollEntries[DX_ETH2USB__APP__POLL_ENTRY_CNT];
+	DX_ETH2USB_App_UsbThread_Cache_t cache;
 } DX_ETH2USB_App_UsbThreadState_t;
 
 typedef struct {
 	// Memory pool identifiers.
 	osMemoryPoolId_t commandMemPoolId;
 	osMemoryPoolId_t responseMemPoolId;
+	// Rings between the Ethernet and the USB thread, as large as the pools so that they
+	//  never fill up.
+	DX_ETH2USB_Ring_t commandRing;
+	void *commandRingSlots[DX__ETH2USB__RING__SLOT_CNT(DX_ETH2USB__APP__COMMAND_MEM_POOL_SIZE)];
+	DX_ETH2USB_Ring_t responseRing;
+	void *responseRingSlots[DX__ETH2USB__RING__SLOT_CNT(DX_ETH2USB__APP__RESPONSE_MEM_POOL_SIZE)];
 	// Message queues.
-	osMessageQueueId_t responseMsgQueueId;
-	osMessageQueueId_t commandMsgQueueId;
+	osMessageQueueId_t completionMsgQueueId;
+	osMessageQueueId_t telemetryMsgQueueId;
+	osMessageQueueId_t pollCompletionMsgQueueId;
 	// Thread attributes.
 	osThreadAttr_t ethThreadAttr;
 	osThreadAttr_t usbThreadAttr;
@@ -72,6 +289,9 @@ typedef struct {
 	DX_ETH2USB_App_EthThreadState_t ethThreadState;
 	DX_ETH2USB_App_StatusThreadState_t statusThreadState;
 	DX_ETH2USB_App_UsbThreadState_t usbThreadState;
+	// Latency histograms, the stages up to the response being enqueued are recorded by the
+	//  USB thread and the others by the Ethernet thread.
+	DX_ETH2USB_Latency_t latency;
 } DX_ETH2USB_AppState_t;
 
 /**
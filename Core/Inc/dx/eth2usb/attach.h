@@ -0,0 +1,23 @@
+/*
+ * attach.h
+ *
+ *  Created on: Oct 17, 2026
+ */
+
+#ifndef INC_DX_ETH2USB_ATTACH_H_
+#define INC_DX_ETH2USB_ATTACH_H_
+
+#include <stdint.h>
+
+#define DX__ETH2USB__ATTACH__NOT_YET 0xFFFFFFFFU
+
+/// The payload of the response to an attach statistics command, about the last time the
+///  device of the command got plugged in.
+typedef struct __attribute__ (( packed )) {
+	uint32_t connectionNo;		/* Counts the times the device got plugged in (network byte order). */
+	uint32_t plugToReadyMs;		/* Until the device could take commands, or DX__ETH2USB__ATTACH__NOT_YET (network byte order). */
+	uint32_t plugToFirstCommandMs;	/* Until a command got served by it, or DX__ETH2USB__ATTACH__NOT_YET (network byte order). */
+	uint8_t reserved[4];		/* Reserved for future usage, zero for now. */
+} DX_ETH2USB_AttachStats_t;
+
+#endif /* INC_DX_ETH2USB_ATTACH_H_ */
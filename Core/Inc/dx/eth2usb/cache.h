@@ -0,0 +1,19 @@
+/*
+ * cache.h
+ *
+ *  Created on: Oct 17, 2026
+ */
+
+#ifndef INC_DX_ETH2USB_CACHE_H_
+#define INC_DX_ETH2USB_CACHE_H_
+
+#include <stdint.h>
+
+/// The payload of the response to a cache statistics command.
+typedef struct __attribute__ (( packed )) {
+	uint32_t nHits;				/* Idempotent commands answered from the cache (network byte order). */
+	uint32_t nMisses;			/* Idempotent commands that had to be sent to the servo (network byte order). */
+	uint32_t nInvalidations;	/* Times the entries of a device got dropped (network byte order). */
+} DX_ETH2USB_CacheStats_t;
+
+#endif /* INC_DX_ETH2USB_CACHE_H_ */
@@ -13,6 +13,21 @@
 #include "settings.h"
 
 #define DX__ETH2USB__COMMAND__PAYLOAD_BUFFER_SIZE DX_ETH2USB__MAX_PACKET_SIZE
+#define DX__ETH2USB__COMMAND_V2__PAYLOAD_BUFFER_SIZE DX_ETH2USB__MAX_TRANSFER_SIZE
+
+#define DX__ETH2USB__COMMAND_FLAG__WR_ONLY 0x01U		/* Same bit as wrOnly in the version 1 header. */
+#define DX__ETH2USB__COMMAND_FLAG__IDEMPOTENT 0x02U	/* Servo commands only: reading has no side effects, so the response may be cached. */
+#define DX__ETH2USB__COMMAND_FLAG__DEVICE_MASK 0xF0U	/* The device the command is for, zero for version 1. */
+#define DX__ETH2USB__COMMAND_FLAG__DEVICE_SHIFT 4U
+
+#define DX__ETH2USB__COMMAND_TYPE__SERVO 0x00U		/* The payload gets sent to the servo as is. */
+#define DX__ETH2USB__COMMAND_TYPE__BATCH 0x01U		/* The payload holds sub-commands, see DX_ETH2USB_SubCommandHeader_t. */
+#define DX__ETH2USB__COMMAND_TYPE__SUBSCRIBE 0x02U	/* A non-zero first payload byte subscribes the session to the telemetry of the device, anything else unsubscribes. */
+#define DX__ETH2USB__COMMAND_TYPE__POLL_CONFIGURE 0x03U	/* Configures an entry of the status table, see DX_ETH2USB_PollConfigHeader_t. */
+#define DX__ETH2USB__COMMAND_TYPE__POLL_READ 0x04U	/* Reads entries of the status table, see DX_ETH2USB_PollResultHeader_t. */
+#define DX__ETH2USB__COMMAND_TYPE__CACHE_STATS 0x05U	/* Reads the counters of the response cache, see DX_ETH2USB_CacheStats_t. */
+#define DX__ETH2USB__COMMAND_TYPE__ATTACH_STATS 0x06U	/* Reads how long the device took to come up when last plugged in, see DX_ETH2USB_AttachStats_t. */
+#define DX__ETH2USB__COMMAND_TYPE__LATENCY_STATS 0x07U	/* Reads the latency histogram of the stage in the first payload byte, see DX_ETH2USB_LatencyStats_t. */
 
 typedef struct __attribute__ (( packed )) {
 	unsigned wrOnly : 1;		/* Indicates that this is a write only command (we don't expect a response). */
@@ -24,4 +39,31 @@ typedef struct __attribute__ (( packed )) {
 	uint8_t payload[DX__ETH2USB__COMMAND__PAYLOAD_BUFFER_SIZE];
 } DX_ETH2USB_Command_t;
 
+typedef struct __attribute__ (( packed )) {
+	uint8_t flags;				/* See DX__ETH2USB__COMMAND_FLAG__*. */
+	uint8_t type;				/* See DX__ETH2USB__COMMAND_TYPE__*. */
+	uint16_t requestId;			/* Chosen by the client, echoed in the response header. */
+	uint16_t length;			/* Number of payload bytes following the header (network byte order). */
+	uint16_t maxResponseLength;	/* Number of bytes to read from the servo, zero for a single packet (network byte order). */
+} DX_ETH2USB_CommandHeaderV2_t;
+
+typedef struct __attribute__ (( packed )) {
+	DX_ETH2USB_CommandHeaderV2_t header;
+	uint8_t payload[DX__ETH2USB__COMMAND_V2__PAYLOAD_BUFFER_SIZE];
+} DX_ETH2USB_CommandV2_t;
+
+/// Precedes every sub-command in the payload of a batch command. The sub-commands are
+///  executed in order, and the batch stops at the first one that fails.
+typedef struct __attribute__ (( packed )) {
+	uint8_t flags;				/* See DX__ETH2USB__COMMAND_FLAG__*. */
+	uint8_t reserved;			/* Reserved for future usage, must be zero. */
+	uint16_t length;			/* Number of payload bytes following the header (network byte order). */
+	uint16_t maxResponseLength;	/* Number of bytes to read from the servo, zero for a single packet (network byte order). */
+} DX_ETH2USB_SubCommandHeader_t;
+
+typedef struct __attribute__ (( packed )) {
+	uint32_t seqNo;				/* Sequence number (network byte order), echoed in the response. */
+	DX_ETH2USB_Command_t command;
+} DX_ETH2USB_CommandDatagram_t;
+
 #endif /* INC_COMMAND_H_ */
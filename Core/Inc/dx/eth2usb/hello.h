@@ -0,0 +1,28 @@
+/*
+ * hello.h
+ *
+ *  Created on: Oct 17, 2026
+ */
+
+#ifndef INC_DX_ETH2USB_HELLO_H_
+#define INC_DX_ETH2USB_HELLO_H_
+
+#include <stdint.h>
+
+// Clients that connect to the hello port send a hello as their first frame, the ones that
+//  connect to the command port are served with version 1 right away.
+#define DX__ETH2USB__HELLO__MAGIC 0xA5U
+
+#define DX__ETH2USB__PROTOCOL_VERSION__1 1U		/* Fixed 65 byte commands, 64 byte responses. */
+#define DX__ETH2USB__PROTOCOL_VERSION__2 2U		/* Length prefixed frames with request identifiers. */
+#define DX__ETH2USB__PROTOCOL_VERSION__LATEST DX__ETH2USB__PROTOCOL_VERSION__2
+
+/// Sent by the client right after connecting, the gateway answers with a hello that
+///  holds the version it will speak from then on, and the initial credits.
+typedef struct __attribute__ (( packed )) {
+	uint8_t magic;				/* Always DX__ETH2USB__HELLO__MAGIC. */
+	uint8_t version;			/* Requested or accepted protocol version. */
+	uint8_t credits;			/* Zero from the client, the number of free command slots from the gateway. */
+} DX_ETH2USB_Hello_t;
+
+#endif /* INC_DX_ETH2USB_HELLO_H_ */
@@ -0,0 +1,83 @@
+/*
+ * latency.h
+ *
+ *  Created on: Oct 17, 2026
+ */
+
+#ifndef INC_DX_ETH2USB_LATENCY_H_
+#define INC_DX_ETH2USB_LATENCY_H_
+
+#include <stdint.h>
+
+/// The points a command gets timestamped at on its way through the gateway.
+#define DX__ETH2USB__LATENCY__STAMP__RECEIVED 0U			/* The frame or datagram got received entirely. */
+#define DX__ETH2USB__LATENCY__STAMP__ENQUEUED 1U			/* Handed over to the USB thread. */
+#define DX__ETH2USB__LATENCY__STAMP__OUT_SUBMITTED 2U		/* The first OUT transfer got started. */
+#define DX__ETH2USB__LATENCY__STAMP__OUT_DONE 3U			/* The last OUT transfer completed. */
+#define DX__ETH2USB__LATENCY__STAMP__IN_DONE 4U			/* The IN transfer completed. */
+#define DX__ETH2USB__LATENCY__STAMP__RESPONSE_ENQUEUED 5U	/* Handed over to the Ethernet thread. */
+#define DX__ETH2USB__LATENCY__STAMP__RESPONSE_WRITTEN 6U	/* Handed over to lwIP entirely. */
+#define DX__ETH2USB__LATENCY__STAMP_CNT 7U
+
+/// Stage n > 0 is the time from stamp n - 1 to stamp n, stage 0 the whole round trip. Only
+///  commands that got both stamps of a stage count towards it.
+#define DX__ETH2USB__LATENCY__STAGE__ROUND_TRIP 0U
+#define DX__ETH2USB__LATENCY__STAGE_CNT DX__ETH2USB__LATENCY__STAMP_CNT
+
+/// The histograms are log-linear, the first SUB_BUCKET_CNT buckets are a microsecond wide
+///  and every power of two above is split into SUB_BUCKET_CNT buckets. Bucket i >= SUB_BUCKET_CNT
+///  starts at (SUB_BUCKET_CNT + i % SUB_BUCKET_CNT) << (i / SUB_BUCKET_CNT - 1) microseconds,
+///  the last one takes everything from there on.
+#define DX__ETH2USB__LATENCY__SUB_BUCKET_BITS 2U
+#define DX__ETH2USB__LATENCY__SUB_BUCKET_CNT (1U << DX__ETH2USB__LATENCY__SUB_BUCKET_BITS)
+#define DX__ETH2USB__LATENCY__MAX_EXPONENT 20U
+#define DX__ETH2USB__LATENCY__BUCKET_CNT ((DX__ETH2USB__LATENCY__MAX_EXPONENT \
+		- DX__ETH2USB__LATENCY__SUB_BUCKET_BITS + 2U) * DX__ETH2USB__LATENCY__SUB_BUCKET_CNT)
+
+/// The payload of the response to a latency statistics command, whose first payload byte
+///  is the stage. Too large for version 1 responses.
+typedef struct __attribute__ (( packed )) {
+	uint8_t stage;				/* See DX__ETH2USB__LATENCY__STAGE__*. */
+	uint8_t subBucketBits;		/* Always DX__ETH2USB__LATENCY__SUB_BUCKET_BITS. */
+	uint8_t bucketCnt;			/* Always DX__ETH2USB__LATENCY__BUCKET_CNT. */
+	uint8_t reserved;			/* Reserved for future usage, zero for now. */
+	uint32_t nSamples;			/* Commands that went through the stage (network byte order). */
+	uint32_t maxMicros;			/* The longest one took (network byte order). */
+	uint32_t buckets[DX__ETH2USB__LATENCY__BUCKET_CNT];	/* Commands per bucket (network byte order). */
+} DX_ETH2USB_LatencyStats_t;
+
+/// The timestamps of a single command, DX__ETH2USB__TIMESTAMP__NONE for the ones it didn't
+///  get (yet).
+typedef struct {
+	uint32_t at[DX__ETH2USB__LATENCY__STAMP_CNT];
+} DX_ETH2USB_Latency_Stamps_t;
+
+typedef struct {
+	uint32_t nSamples;
+	uint32_t maxMicros;
+	uint32_t buckets[DX__ETH2USB__LATENCY__BUCKET_CNT];
+} DX_ETH2USB_Latency_Histogram_t;
+
+/// The histograms of all stages. Every stage has a single writer, so the readers might
+///  see a sample that's counted but not yet in its bucket and nothing worse.
+typedef struct {
+	DX_ETH2USB_Latency_Histogram_t stages[DX__ETH2USB__LATENCY__STAGE_CNT];
+} DX_ETH2USB_Latency_t;
+
+/**
+ * Forgets all timestamps of the given command.
+ */
+void DX_ETH2USB_Latency_ClearStamps(DX_ETH2USB_Latency_Stamps_t *stamps);
+
+/**
+ * Takes the given timestamp of a command, see DX__ETH2USB__LATENCY__STAMP__*.
+ */
+void DX_ETH2USB_Latency_Stamp(DX_ETH2USB_Latency_Stamps_t *stamps, uint8_t stampNo);
+
+/**
+ * Adds the given command to the histograms of the given stage, if it got both stamps of it.
+ */
+void DX_ETH2USB_Latency_Record(DX_ETH2USB_Latency_t *latency,
+		const DX_ETH2USB_Latency_Stamps_t *stamps, uint8_t stage);
+
+#endif /* INC_DX_ETH2USB_LATENCY_H_ */
@@ -0,0 +1,37 @@
+/*
+ * poll.h
+ *
+ *  Created on: Oct 17, 2026
+ */
+
+#ifndef INC_DX_ETH2USB_POLL_H_
+#define INC_DX_ETH2USB_POLL_H_
+
+#include <stdint.h>
+
+#include "settings.h"
+
+#define DX__ETH2USB__POLL__MAX_COMMAND_SIZE DX_ETH2USB__MAX_PACKET_SIZE
+#define DX__ETH2USB__POLL__MAX_RESULT_SIZE DX_ETH2USB__MAX_PACKET_SIZE
+
+/// Precedes the servo command in the payload of a poll configuration command, the device
+///  the entry polls is the one of the command.
+typedef struct __attribute__ (( packed )) {
+	uint8_t entryNo;			/* The entry of the status table, below DX_ETH2USB__APP__POLL_ENTRY_CNT. */
+	uint8_t reserved;			/* Reserved for future usage, must be zero. */
+	uint16_t intervalMs;		/* How often the command gets sent, zero disables the entry (network byte order). */
+	uint16_t maxResponseLength;	/* Number of bytes to read from the servo, zero for a single packet (network byte order). */
+} DX_ETH2USB_PollConfigHeader_t;
+
+/// Precedes the latest result of every entry in the payload of the response to a poll read
+///  command, whose payload lists the entry numbers.
+typedef struct __attribute__ (( packed )) {
+	uint8_t status;				/* See DX__ETH2USB__RESPONSE_STATUS__*, an error until the entry got polled. */
+	uint8_t reserved;			/* Reserved for future usage, zero for now. */
+	uint16_t length;			/* Number of result bytes following the header (network byte order). */
+	uint32_t timestamp;			/* Milliseconds since the gateway started when the result arrived (network byte order). */
+	uint32_t age;				/* Milliseconds since the result arrived (network byte order). */
+	uint32_t nUpdates;			/* Number of results since the entry got configured (network byte order). */
+} DX_ETH2USB_PollResultHeader_t;
+
+#endif /* INC_DX_ETH2USB_POLL_H_ */
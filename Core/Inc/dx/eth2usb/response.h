@@ -13,9 +13,44 @@
 #include "settings.h"
 
 #define DX__ETH2USB__RESPONSE__PAYLOAD_BUFFER_SIZE DX_ETH2USB__MAX_PACKET_SIZE
+#define DX__ETH2USB__RESPONSE_V2__PAYLOAD_BUFFER_SIZE DX_ETH2USB__MAX_TRANSFER_SIZE
+
+#define DX__ETH2USB__RESPONSE_STATUS__OK 0x00U
+#define DX__ETH2USB__RESPONSE_STATUS__ERR 0x01U			/* The servo could not be commanded. */
+
+#define DX__ETH2USB__RESPONSE_FLAG__TELEMETRY 0x01U		/* Not a response but a telemetry report, the request identifier is zero. */
+#define DX__ETH2USB__RESPONSE_FLAG__DEVICE_MASK 0xF0U	/* Telemetry only: the device that reported. */
+#define DX__ETH2USB__RESPONSE_FLAG__DEVICE_SHIFT 4U
 
 typedef struct __attribute__ (( packed )) {
 	uint8_t payload[DX__ETH2USB__RESPONSE__PAYLOAD_BUFFER_SIZE];
 } DX_ETH2USB_Response_t;
 
+typedef struct __attribute__ (( packed )) {
+	uint8_t flags;				/* See DX__ETH2USB__RESPONSE_FLAG__*. */
+	uint8_t status;				/* See DX__ETH2USB__RESPONSE_STATUS__*. */
+	uint16_t requestId;			/* The request identifier of the command. */
+	uint16_t length;			/* Number of payload bytes following the header (network byte order). */
+	uint8_t credits;			/* Number of free command slots at the time the response got written. */
+	uint8_t reserved;			/* Reserved for future usage, zero for now. */
+} DX_ETH2USB_ResponseHeaderV2_t;
+
+typedef struct __attribute__ (( packed )) {
+	DX_ETH2USB_ResponseHeaderV2_t header;
+	uint8_t payload[DX__ETH2USB__RESPONSE_V2__PAYLOAD_BUFFER_SIZE];
+} DX_ETH2USB_ResponseV2_t;
+
+/// Precedes the response of every executed sub-command in the payload of the response
+///  to a batch command. Write only sub-commands get one with a zero length.
+typedef struct __attribute__ (( packed )) {
+	uint8_t flags;				/* Reserved for future usage, zero for now. */
+	uint8_t status;				/* See DX__ETH2USB__RESPONSE_STATUS__*. */
+	uint16_t length;			/* Number of payload bytes following the header (network byte order). */
+} DX_ETH2USB_SubResponseHeader_t;
+
+typedef struct __attribute__ (( packed )) {
+	uint32_t seqNo;				/* Sequence number of the command (network byte order). */
+	DX_ETH2USB_Response_t response;
+} DX_ETH2USB_ResponseDatagram_t;
+
 #endif /* INC_DX_ETH2USB_RESPONSE_H_ */
@@ -0,0 +1,43 @@
+/*
+ * ring.h
+ *
+ *  Created on: Oct 17, 2026
+ */
+
+#ifndef INC_DX_ETH2USB_RING_H_
+#define INC_DX_ETH2USB_RING_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/// The number of slots a ring that holds the given number of pointers needs, one slot
+///  always stays free to tell a full ring from an empty one.
+#define DX__ETH2USB__RING__SLOT_CNT(capacity) ((capacity) + 1U)
+
+/// A lock-free ring of pointers between a single producer and a single consumer thread,
+///  the slots are provided by the owner.
+typedef struct {
+	void **slots;
+	uint32_t slotCnt;
+	volatile uint32_t head;		/* The next slot to pop, only written by the consumer. */
+	volatile uint32_t tail;		/* The next slot to push, only written by the producer. */
+} DX_ETH2USB_Ring_t;
+
+/**
+ * Initializes the given ring over the given slots, see DX__ETH2USB__RING__SLOT_CNT.
+ */
+void DX_ETH2USB_Ring_Init(DX_ETH2USB_Ring_t *ring, void **slots, uint32_t slotCnt);
+
+/**
+ * Pushes the given pointer, only to be called by the producer. Returns false if the ring is
+ *  full, sets wasEmpty if the consumer might have seen the ring empty and needs waking.
+ */
+bool DX_ETH2USB_Ring_Push(DX_ETH2USB_Ring_t *ring, void *item, bool *wasEmpty);
+
+/**
+ * Pops the oldest pointer, only to be called by the consumer. Returns false if the ring
+ *  is empty.
+ */
+bool DX_ETH2USB_Ring_Pop(DX_ETH2USB_Ring_t *ring, void **item);
+
+#endif /* INC_DX_ETH2USB_RING_H_ */
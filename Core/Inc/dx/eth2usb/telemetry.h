@@ -0,0 +1,34 @@
+/*
+ * telemetry.h
+ *
+ *  Created on: Oct 17, 2026
+ */
+
+#ifndef INC_DX_ETH2USB_TELEMETRY_H_
+#define INC_DX_ETH2USB_TELEMETRY_H_
+
+#include <stdint.h>
+
+#include "settings.h"
+
+#define DX__ETH2USB__TELEMETRY__SUBSCRIPTION_MAGIC 0x54U
+
+/// Sent by a datagram peer to get the telemetry reports of the servos, it has to be sent
+///  again within DX_ETH2USB__APP__TELEMETRY_LEASE_MS to keep getting them. Any other
+///  datagram of the peer renews the lease as well.
+typedef struct __attribute__ (( packed )) {
+	uint8_t magic;				/* Always DX__ETH2USB__TELEMETRY__SUBSCRIPTION_MAGIC. */
+	uint8_t deviceMask;			/* Bit n subscribes to device n, zero unsubscribes. */
+} DX_ETH2USB_TelemetrySubscriptionDatagram_t;
+
+/// Carries a single telemetry report to a datagram peer, only the received part of the
+///  payload gets sent.
+typedef struct __attribute__ (( packed )) {
+	uint32_t seqNo;				/* Counts the telemetry datagrams of the peer (network byte order). */
+	uint8_t deviceNo;			/* The device that reported. */
+	uint8_t reserved;			/* Reserved for future usage, zero for now. */
+	uint16_t length;			/* Number of payload bytes following the header (network byte order). */
+	uint8_t payload[DX_ETH2USB__MAX_PACKET_SIZE];
+} DX_ETH2USB_TelemetryDatagram_t;
+
+#endif /* INC_DX_ETH2USB_TELEMETRY_H_ */
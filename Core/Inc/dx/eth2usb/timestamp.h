@@ -0,0 +1,32 @@
+/*
+ * timestamp.h
+ *
+ *  Created on: Oct 17, 2026
+ */
+
+#ifndef INC_DX_ETH2USB_TIMESTAMP_H_
+#define INC_DX_ETH2USB_TIMESTAMP_H_
+
+#include <stdint.h>
+
+/// Marks a timestamp that hasn't been taken, DX_ETH2USB_Timestamp_Now never returns it.
+#define DX__ETH2USB__TIMESTAMP__NONE 0U
+
+/**
+ * Starts the cycle counter of the DWT, which the timestamps are taken from.
+ */
+void DX_ETH2USB_Timestamp_Init(void);
+
+/**
+ * Gets the current timestamp in CPU cycles, it wraps around every few seconds so only
+ *  differences between two timestamps are meaningful. The lowest bit is always set, so
+ *  it's never DX__ETH2USB__TIMESTAMP__NONE.
+ */
+uint32_t DX_ETH2USB_Timestamp_Now(void);
+
+/**
+ * Converts a difference between two timestamps to microseconds.
+ */
+uint32_t DX_ETH2USB_Timestamp_ToMicros(uint32_t cycles);
+
+#endif /* INC_DX_ETH2USB_TIMESTAMP_H_ */
@@ -13,6 +13,11 @@
 #define DX_ETH2USB__USB_DEVICE__PRIMARY_ENDPOINT_NO 2
 #define DX_ETH2USB__USB_DEVICE__PRIMARY_PIPE_NO 1
 #define DX_ETH2USB__MAX_PACKET_SIZE 64
+#define DX_ETH2USB__MAX_TRANSFER_SIZE 2048
+
+// Lets the OTG core move transfer data by DMA. Everything it moves data from or to lives in the
+//  non-cacheable window that is the .UsbDmaSection (see main.c), or gets cleaned or invalidated.
+#define DX_ETH2USB__USB__DMA
 
 #define DX_ETH2USB__USB_DEVICE__CLASS_CODE 0xFF
 
@@ -26,13 +31,69 @@
 
 #define DX_ETH2USB__STATE_MACHINE__USB_EVENT_MAX_MSG_CNT 4
 
+// One Active Servo per USB host port, commands pick theirs by device number (see command.h).
+//  The STM32H723 has a single OTG core, the USB_FS pins are the embedded full speed PHY of
+//  USB_OTG_HS, so more than one device needs a part that also has USB2_OTG_FS.
+#define DX_ETH2USB__USB__MAX_DEVICE_CNT 1
+
+#define DX_ETH2USB__ACTIVE_SERVO_CLASS__SUBMISSION_RING_SIZE 4
+// Milliseconds a submission may wait for room in the submission ring, detaching the device
+//  waits for it as well.
+#define DX_ETH2USB__ACTIVE_SERVO_CLASS__SUBMIT_TIMEOUT 10
+// Arms the IN transfer of a command together with its OUT transfer, and sends the next command
+//  while the response of the current one is still being read. Needs a servo that buffers commands.
+//#define DX_ETH2USB__ACTIVE_SERVO_CLASS__PREARM_IN
+// Frames a command may take from being picked up to its response, after that it fails and the
+//  end-points get their halt cleared. The recovery itself gets the other one.
+#define DX_ETH2USB__ACTIVE_SERVO_CLASS__CMD_TIMEOUT 100
+#define DX_ETH2USB__ACTIVE_SERVO_CLASS__RECOVERY_TIMEOUT 500
+// A NAKed OUT chunk gets written again right away this often, then after a backoff that
+//  doubles per NAK up to the given number of frames.
+#define DX_ETH2USB__ACTIVE_SERVO_CLASS__NAK_RETRY_CNT 3
+#define DX_ETH2USB__ACTIVE_SERVO_CLASS__MAX_NAK_BACKOFF 8
+
 #define DX_ETH2USB__STATUS__ETHERNET_BLINK_INTERVAL 300
 #define DX_ETH2USB__STATUS__USB_BLINK_INTERVAL 300
 
 #define DX_ETH2USB__APP__RESPONSE_MEM_POOL_SIZE 12
 #define DX_ETH2USB__APP__COMMAND_MEM_POOL_SIZE 12
 
-#define DX_ETH2USB__APP__COMMAND_MSG_QUEUE_SIZE 10
-#define DX_ETH2USB__APP__RESPONSE_MSG_QUEUE_SIZE 10
+// In bytes, the stacks are allocated statically in the DTCM.
+#define DX_ETH2USB__APP__ETH_THREAD_STACK_SIZE 1024
+#define DX_ETH2USB__APP__USB_THREAD_STACK_SIZE 2048
+#define DX_ETH2USB__APP__STATUS_THREAD_STACK_SIZE 256
+
+#define DX_ETH2USB__APP__MAX_SESSION_CNT 4
+// Response slots a session may hold, counting the commands that will produce one. The
+//  sessions together must leave slots that get freed without any client's help.
+#define DX_ETH2USB__APP__MAX_SESSION_RESPONSE_CNT 2
+#define DX_ETH2USB__APP__MAX_UDP_PEER_CNT 4
+
+#define DX_ETH2USB__APP__TELEMETRY_MSG_QUEUE_SIZE 8
+// Response slots telemetry never takes, so that commands keep getting answered while
+//  subscribers are slow to acknowledge.
+#define DX_ETH2USB__APP__TELEMETRY_RESPONSE_RESERVE 2
+// How long a datagram peer keeps getting telemetry after the last datagram it sent.
+#define DX_ETH2USB__APP__TELEMETRY_LEASE_MS 5000
+
+// Entries of the status table, each polls a servo command of its own (see poll.h).
+#define DX_ETH2USB__APP__POLL_ENTRY_CNT 16
+// Responses to commands flagged idempotent get answered from the cache until they expire, or
+//  any other command gets sent to their device.
+#define DX_ETH2USB__APP__RESPONSE_CACHE_ENTRY_CNT 16
+#define DX_ETH2USB__APP__RESPONSE_CACHE_TTL_MS 1000
+
+// How often the USB thread checks whether a device that work waits for showed up.
+#define DX_ETH2USB__APP__DEVICE_RECHECK_INTERVAL_MS 50
+
+#define DX_ETH2USB__APP__FLUSH_POLICY__IMMEDIATE 0		/* Writes whatever is queued as soon as possible. */
+#define DX_ETH2USB__APP__FLUSH_POLICY__COALESCE 1		/* Waits for FLUSH_COALESCE_CNT responses, or FLUSH_COALESCE_TIMEOUT_US. */
+#define DX_ETH2USB__APP__FLUSH_POLICY DX_ETH2USB__APP__FLUSH_POLICY__IMMEDIATE
+#define DX_ETH2USB__APP__FLUSH_COALESCE_CNT 2
+#define DX_ETH2USB__APP__FLUSH_COALESCE_TIMEOUT_US 250
+#define DX_ETH2USB__APP__MAX_FLUSH_VECTOR_CNT 8
+
+// Disables Nagle's algorithm on client connections, responses get coalesced by the flush policy instead.
+#define DX_ETH2USB__APP__TCP_NODELAY
 
 #endif /* INC_SETTINGS_H_ */
@@ -5,12 +5,79 @@
  *      Author: luke
  */
 
+#include <string.h>
+
+#include <FreeRTOS.h>
+
 #include "dx/eth2usb/active_servo_class.h"
 #include "dx/eth2usb/active_servo_class_states/idle.h"
 #include "dx/eth2usb/active_servo_class_states/writing.h"
 #include "dx/eth2usb/active_servo_class_states/reading.h"
+#include "dx/eth2usb/active_servo_class_states/error.h"
+#include "dx/eth2usb/timestamp.h"
 #include "settings.h"
 #include "logging.h"
+#include "main.h"
+
+#define DX_USB_ACTIVE_SERVO_CLASS__CACHE_LINE_SIZE 32U
+#define DX_USB_ACTIVE_SERVO_CLASS__DTCM_SIZE 0x20000U
+
+/// Bounce buffers for the transfers whose buffers the OTG DMA can't use directly, and
+///  the buffer telemetry reports get received into.
+typedef struct {
+	uint8_t out[DX_ETH2USB__MAX_PACKET_SIZE];
+	uint8_t in[DX_ETH2USB__MAX_TRANSFER_SIZE];
+	uint8_t telemetry[DX_ETH2USB__MAX_PACKET_SIZE];
+} DX_ActiveServoClass_DmaBuffers_TypeDef;
+
+static DX_ActiveServoClass_DmaBuffers_TypeDef gDxActiveServoClassDmaBuffers[DX_ETH2USB__USB__MAX_DEVICE_CNT]
+		__attribute__((section(".UsbDmaSection"), aligned(32)));
+
+/// Whoever gets the telemetry reports of a device, kept outside the handle since that one
+///  only exists while the device is attached.
+typedef struct {
+	DX_ActiveServoClass_TelemetryCallback_TypeDef callback;
+	void *arg;
+} DX_ActiveServoClass_TelemetrySubscriber_TypeDef;
+
+static DX_ActiveServoClass_TelemetrySubscriber_TypeDef gDxActiveServoClassTelemetrySubscribers[DX_ETH2USB__USB__MAX_DEVICE_CNT];
+
+/// Whoever wants to know when a device can take commands, see DX_ActiveServoClass_SetReadyCallback.
+typedef struct {
+	DX_ActiveServoClass_ReadyCallback_TypeDef callback;
+	void *arg;
+} DX_ActiveServoClass_ReadySubscriber_TypeDef;
+
+static DX_ActiveServoClass_ReadySubscriber_TypeDef gDxActiveServoClassReadySubscribers[DX_ETH2USB__USB__MAX_DEVICE_CNT];
+
+/// The handles outlive the devices, so that their mutex and message queues only get
+///  created once instead of on every attach.
+static DX_ActiveServoClass_HandleTypeDef gDxActiveServoClassHandles[DX_ETH2USB__USB__MAX_DEVICE_CNT]
+		__attribute__((section(".DtcmSection")));
+
+/// Whether a device is attached and takes submissions. Kept outside the handle, which gets
+///  reset on attach while submitters might be looking.
+typedef struct {
+	osMutexId_t mutexId;		/* Held while changing attached, and while submitting. */
+	bool attached;
+} DX_ActiveServoClass_Attachment_TypeDef;
+
+static DX_ActiveServoClass_Attachment_TypeDef gDxActiveServoClassAttachments[DX_ETH2USB__USB__MAX_DEVICE_CNT];
+
+/// The control blocks and storage of the mutexes and message queues of a handle. Only
+///  the CPU touches them, so they live in the DTCM next to the handles.
+typedef struct {
+	StaticSemaphore_t attachmentMutexCb;
+	StaticSemaphore_t availabilityMutexCb;
+	StaticQueue_t cmdMsgQueueCb;
+	uint8_t cmdMsgQueueMem[DX_ETH2USB__ACTIVE_SERVO_CLASS__SUBMISSION_RING_SIZE
+			* sizeof(DX_ActiveServoClass_Cmd_TypeDef)];
+	StaticQueue_t rspMsgQueueCb;
+	uint8_t rspMsgQueueMem[sizeof(DX_ActiveServoClass_Rsp_TypeDef)];
+} DX_ActiveServoClass_Objects_TypeDef;
+
+static DX_ActiveServoClass_Objects_TypeDef gDxActiveServoClassObjects[DX_ETH2USB__USB__MAX_DEVICE_CNT]
+		__attribute__((section(".DtcmSection"), aligned(8)));
 
 static USBH_StatusTypeDef DX_USB_ActiveServoClass_InterfaceInit(
 		USBH_HandleTypeDef *phost);
@@ -23,20 +90,99 @@ static USBH_StatusTypeDef DX_USB_ActiveServoClass_ClassRequest(
 static USBH_StatusTypeDef DX_USB_ActiveServoClass_SOFProcess(
 		USBH_HandleTypeDef *phost);
 
-USBH_ClassTypeDef gDxActiveServoClass = { .Name = "Active Servo",
+/// One instance per device, since the USB host library keeps the handle in the class.
+USBH_ClassTypeDef gDxActiveServoClass[DX_ETH2USB__USB__MAX_DEVICE_CNT] = {
+		[0 ... DX_ETH2USB__USB__MAX_DEVICE_CNT - 1] = { .Name = "Active Servo",
 		.ClassCode = DX_ETH2USB__USB_DEVICE__CLASS_CODE, .Init =
 				DX_USB_ActiveServoClass_InterfaceInit, .DeInit =
 				DX_USB_ActiveServoClass_InterfaceDeInit, .Requests =
 				DX_USB_ActiveServoClass_ClassRequest, .BgndProcess =
 				DX_USB_ActiveServoClass_Process, .SOFProcess =
-				DX_USB_ActiveServoClass_SOFProcess, .pData = NULL, };
+				DX_USB_ActiveServoClass_SOFProcess, .pData = NULL, } };
 
-/// The function that gets called to initialize the interface.
-static USBH_StatusTypeDef DX_USB_ActiveServoClass_InterfaceInit(
+/// Gets the number of the device the given host talks to.
+static uint8_t DX_USB_ActiveServoClass_DeviceNo(USBH_HandleTypeDef *phost) {
+	return (uint8_t) (phost->pActiveClass - gDxActiveServoClass);
+}
+
+/// Sets whether the device takes submissions, waits for a submission in progress.
+static void DX_USB_ActiveServoClass_SetAttached(USBH_HandleTypeDef *phost, bool attached) {
+	DX_ActiveServoClass_Attachment_TypeDef *attachment =
+			&gDxActiveServoClassAttachments[DX_USB_ActiveServoClass_DeviceNo(phost)];
+
+	if (attachment->mutexId == NULL)
+		return;
+
+	if (osMutexAcquire(attachment->mutexId, osWaitForever) != osOK)
+		Error_Handler();
+
+	attachment->attached = attached;
+
+	if (osMutexRelease(attachment->mutexId) != osOK)
+		Error_Handler();
+}
+
+/// Gets the bounce buffers of the device the given host talks to.
+static DX_ActiveServoClass_DmaBuffers_TypeDef* DX_USB_ActiveServoClass_DmaBuffers(
 		USBH_HandleTypeDef *phost) {
-	DX_ActiveServoClass_HandleTypeDef *handle = NULL;
-	USBH_InterfaceDescTypeDef *interface = NULL;
+	return &gDxActiveServoClassDmaBuffers[DX_USB_ActiveServoClass_DeviceNo(phost)];
+}
+
+/// Opens the pipe of the interrupt IN end-point the servo reports telemetry on, servos
+///  without one just don't report any.
+static USBH_StatusTypeDef DX_USB_ActiveServoClass_InterfaceInit_Telemetry(
+		USBH_HandleTypeDef *phost, USBH_InterfaceDescTypeDef *interface) {
+	DX_ActiveServoClass_HandleTypeDef *handle =
+			(DX_ActiveServoClass_HandleTypeDef*) phost->pActiveClass->pData;
+	USBH_EpDescTypeDef *ep = NULL;
 	USBH_StatusTypeDef status = USBH_OK;
+	uint8_t pipeNo = 0U;
+
+	for (uint8_t i = 0U; i < interface->bNumEndpoints && i < USBH_MAX_NUM_ENDPOINTS;
+			++i) {
+		if ((interface->Ep_Desc[i].bmAttributes & 0x03U) == USB_EP_TYPE_INTR
+				&& (interface->Ep_Desc[i].bEndpointAddress & 0x80U)) {
+			ep = &interface->Ep_Desc[i];
+			break;
+		}
+	}
+
+	if (ep == NULL) {
+		mlog("Interface has no interrupt IN end-point, there won't be telemetry");
+		return USBH_OK;
+	}
+
+	pipeNo = USBH_AllocPipe(phost, ep->bEndpointAddress);
+	if (pipeNo == 0xFFU) {
+		mlog("No pipe left for the interrupt IN end-point, there won't be telemetry");
+		return USBH_OK;
+	}
+
+	handle->intEpAddr = ep->bEndpointAddress;
+	handle->intEpMaxPktSize = ep->wMaxPacketSize;
+	handle->intPipeNo = pipeNo;
+	handle->intPollInterval = ep->bInterval > 0U ? ep->bInterval : 1U;
+
+	status = USBH_OpenPipe(phost, handle->intPipeNo, handle->intEpAddr,
+			phost->device.address, phost->device.speed,
+			USB_EP_TYPE_INTR, handle->intEpMaxPktSize);
+	if (status != USBH_OK) {
+		mlog("Failed to open interrupt pipe");
+		return USBH_FAIL;
+	}
+	mlog("Created interrupt pipe with address %02x on end-point with address %02x, "
+			"polled every %u frames", handle->intPipeNo, handle->intEpAddr,
+			handle->intPollInterval);
+
+	USBH_LL_SetToggle(phost, handle->intPipeNo, 0U);
+
+	return USBH_OK;
+}
+
+/// Finds the interface of the servo, and makes sure its end-points are what we expect.
+static USBH_StatusTypeDef DX_USB_ActiveServoClass_InterfaceInit_FindInterface(
+		USBH_HandleTypeDef *phost, uint8_t *index) {
+	USBH_InterfaceDescTypeDef *interface = NULL;
 	uint8_t interfaceIndex = 0U;
 
 	// Finds the index of the specific interface we need.
@@ -55,14 +201,6 @@ static USBH_StatusTypeDef DX_USB_ActiveServoClass_InterfaceInit(
 	// Gets the specific interface from the index.
 	interface = &phost->device.CfgDesc.Itf_Desc[interfaceIndex];
 
-	// Selects the interface.
-	status = USBH_SelectInterface(phost, interfaceIndex);
-	if (status != USBH_OK) {
-		mlog("Failed to select interface");
-		return USBH_FAIL;
-	}
-	mlog("Selected interface %d", interfaceIndex);
-
 	// Makes sure that the third end-point is of type input.
 	if (!(interface->Ep_Desc[2U].bEndpointAddress & 0x80U)) {
 		mlog("Third end-point of the interface is not of type IN");
@@ -76,18 +214,133 @@ static USBH_StatusTypeDef DX_USB_ActiveServoClass_InterfaceInit(
 	}
 	mlog("Fourth end-point is of type OUT and has address %02x", interface->Ep_Desc[3U].bEndpointAddress);
 
-	// Allocates the memory needed for the handle.
-	phost->pActiveClass->pData = USBH_malloc(
-			sizeof(DX_ActiveServoClass_HandleTypeDef));
-	handle = (DX_ActiveServoClass_HandleTypeDef*) phost->pActiveClass->pData;
-	if (handle == NULL) {
-		mlog("Failed to allocate memory for ActiveServoClass handle");
-		return USBH_FAIL;
-	}
+	*index = interfaceIndex;
+
+	return USBH_OK;
+}
+
+/// Resets the handle of the device for a new attach, its mutex and message queues get
+///  created on the first one and are kept from then on.
+static USBH_StatusTypeDef DX_USB_ActiveServoClass_InterfaceInit_Handle(
+		USBH_HandleTypeDef *phost) {
+	uint8_t deviceNo = DX_USB_ActiveServoClass_DeviceNo(phost);
+	DX_ActiveServoClass_HandleTypeDef *handle = &gDxActiveServoClassHandles[deviceNo];
+	DX_ActiveServoClass_Objects_TypeDef *objects = &gDxActiveServoClassObjects[deviceNo];
+	DX_ActiveServoClass_Attachment_TypeDef *attachment = &gDxActiveServoClassAttachments[deviceNo];
+	osMutexAttr_t mutexAttr;
+	osMessageQueueAttr_t msgQueueAttr;
+	osMutexId_t availabilityMutexId = handle->availabilityMutexId;
+	osMessageQueueId_t cmdMsgQueueId = handle->cmdMsgQueueId;
+	osMessageQueueId_t rspMsgQueueId = handle->rspMsgQueueId;
 
 	// Clears the memory of the handle to prevent possible UB.
 	USBH_memset(handle, 0, sizeof(DX_ActiveServoClass_HandleTypeDef));
 
+	handle->availabilityMutexId = availabilityMutexId;
+	handle->cmdMsgQueueId = cmdMsgQueueId;
+	handle->rspMsgQueueId = rspMsgQueueId;
+
+	// Creates the attachment mutex, no submitter uses it before it got published.
+	if (attachment->mutexId == NULL) {
+		memset(&mutexAttr, 0, sizeof(mutexAttr));
+		mutexAttr.cb_mem = &objects->attachmentMutexCb;
+		mutexAttr.cb_size = sizeof(objects->attachmentMutexCb);
+
+		attachment->mutexId = osMutexNew(&mutexAttr);
+		if (attachment->mutexId == NULL) {
+			mlog("Failed to create attachment mutex");
+			return USBH_FAIL;
+		}
+	}
+
+	// Creates the availability mutex.
+	if (handle->availabilityMutexId == NULL) {
+		memset(&mutexAttr, 0, sizeof(mutexAttr));
+		mutexAttr.cb_mem = &objects->availabilityMutexCb;
+		mutexAttr.cb_size = sizeof(objects->availabilityMutexCb);
+
+		handle->availabilityMutexId = osMutexNew(&mutexAttr);
+		if (handle->availabilityMutexId == NULL) {
+			mlog("Failed to create availability mutex");
+			return USBH_FAIL;
+		}
+	}
+
+	// Creates the command message queue.
+	if (handle->cmdMsgQueueId == NULL) {
+		memset(&msgQueueAttr, 0, sizeof(msgQueueAttr));
+		msgQueueAttr.cb_mem = &objects->cmdMsgQueueCb;
+		msgQueueAttr.cb_size = sizeof(objects->cmdMsgQueueCb);
+		msgQueueAttr.mq_mem = objects->cmdMsgQueueMem;
+		msgQueueAttr.mq_size = sizeof(objects->cmdMsgQueueMem);
+
+		handle->cmdMsgQueueId = osMessageQueueNew(
+				DX_ETH2USB__ACTIVE_SERVO_CLASS__SUBMISSION_RING_SIZE,
+				sizeof(DX_ActiveServoClass_Cmd_TypeDef), &msgQueueAttr);
+		if (handle->cmdMsgQueueId == NULL) {
+			mlog("Failed to create command message queue");
+			return USBH_FAIL;
+		}
+	}
+
+	// Creates the response message queue.
+	if (handle->rspMsgQueueId == NULL) {
+		memset(&msgQueueAttr, 0, sizeof(msgQueueAttr));
+		msgQueueAttr.cb_mem = &objects->rspMsgQueueCb;
+		msgQueueAttr.cb_size = sizeof(objects->rspMsgQueueCb);
+		msgQueueAttr.mq_mem = objects->rspMsgQueueMem;
+		msgQueueAttr.mq_size = sizeof(objects->rspMsgQueueMem);
+
+		handle->rspMsgQueueId = osMessageQueueNew(1U,
+				sizeof(DX_ActiveServoClass_Rsp_TypeDef), &msgQueueAttr);
+		if (handle->rspMsgQueueId == NULL) {
+			mlog("Failed to create response message queue");
+			return USBH_FAIL;
+		}
+	}
+
+	phost->pActiveClass->pData = handle;
+
+	// Fails whatever got left behind for the previous device, the new one must not get it.
+	while (osMessageQueueGet(handle->cmdMsgQueueId, &handle->cmd, NULL, 0U) == osOK) {
+		mlog("Failing command left behind by the previous device");
+		DX_USB_ActiveServoClass_CompleteCmd(phost, DX__ACTIVE_SERVO_CLASS__ERR, 0U);
+	}
+
+	return USBH_OK;
+}
+
+/// The function that gets called to initialize the interface.
+static USBH_StatusTypeDef DX_USB_ActiveServoClass_InterfaceInit(
+		USBH_HandleTypeDef *phost) {
+	DX_ActiveServoClass_HandleTypeDef *handle = NULL;
+	USBH_InterfaceDescTypeDef *interface = NULL;
+	USBH_StatusTypeDef status = USBH_OK;
+	uint8_t interfaceIndex = 0U;
+
+	// Finds the interface.
+	status = DX_USB_ActiveServoClass_InterfaceInit_FindInterface(phost, &interfaceIndex);
+	if (status != USBH_OK)
+		return USBH_FAIL;
+
+	// Gets the specific interface from the index.
+	interface = &phost->device.CfgDesc.Itf_Desc[interfaceIndex];
+
+	// Selects the interface.
+	status = USBH_SelectInterface(phost, interfaceIndex);
+	if (status != USBH_OK) {
+		mlog("Failed to select interface");
+		return USBH_FAIL;
+	}
+	mlog("Selected interface %d", interfaceIndex);
+
+	// Takes the handle of the device.
+	status = DX_USB_ActiveServoClass_InterfaceInit_Handle(phost);
+	if (status != USBH_OK)
+		return USBH_FAIL;
+
+	handle = (DX_ActiveServoClass_HandleTypeDef*) phost->pActiveClass->pData;
+
 	// Gets the address and the max packet size of the input end-point.
 	handle->inEpAddr = interface->Ep_Desc[2U].bEndpointAddress;
 	handle->inEpMaxPktSize = interface->Ep_Desc[2U].wMaxPacketSize;
@@ -96,6 +349,13 @@ static USBH_StatusTypeDef DX_USB_ActiveServoClass_InterfaceInit(
 	handle->outEpAddr = interface->Ep_Desc[3U].bEndpointAddress;
 	handle->outEpMaxPktSize = interface->Ep_Desc[3U].wMaxPacketSize;
 
+	// OUT data gets written a packet at a time, through a bounce buffer of a packet.
+	if (handle->outEpMaxPktSize == 0U
+			|| handle->outEpMaxPktSize > DX_ETH2USB__MAX_PACKET_SIZE) {
+		mlog("Output end-point has unsupported max packet size %u", handle->outEpMaxPktSize);
+		return USBH_FAIL;
+	}
+
 	// Allocates the memory for the pipes.
 	// TODO: figure out how to handle possible errors here.
 	handle->inPipeNo = USBH_AllocPipe(phost, handle->inEpAddr);
@@ -128,49 +388,66 @@ static USBH_StatusTypeDef DX_USB_ActiveServoClass_InterfaceInit(
 	USBH_LL_SetToggle(phost, handle->inPipeNo, 1U);
 	USBH_LL_SetToggle(phost, handle->outPipeNo, 0U);
 
-	// Creates the availability mutex.
-	handle->availabilityMutexId = osMutexNew(NULL);
-	if (handle->availabilityMutexId == NULL) {
-		mlog("Failed to create availability mutex");
-		return USBH_FAIL;
-	}
-
-	// Creates the command message queue.
-	handle->cmdMsgQueueId = osMessageQueueNew(1U,
-			sizeof(DX_ActiveServoClass_Cmd_TypeDef), NULL);
-	if (handle->cmdMsgQueueId == NULL) {
-		mlog("Failed to create command message queue");
-		return USBH_FAIL;
-	}
-
-	// Creates the response message queue.
-	handle->rspMsgQueueId = osMessageQueueNew(1U,
-			sizeof(DX_ActiveServoClass_Rsp_TypeDef), NULL);
-	if (handle->rspMsgQueueId == NULL) {
-		mlog("Failed to create response message queue");
+	// Opens the telemetry pipe, if there is an end-point for it.
+	status = DX_USB_ActiveServoClass_InterfaceInit_Telemetry(phost, interface);
+	if (status != USBH_OK)
 		return USBH_FAIL;
-	}
 
 	// Sets started to false, to let the state machine know
 	//  it should still start.
 	handle->started = false;
 
+	// From here on commands can be submitted.
+	DX_USB_ActiveServoClass_SetAttached(phost, true);
+
 	// I think the setup was okay?
 	return USBH_OK;
 }
 
+/// Fails the command that is being executed and all the submitted ones, so that
+///  nobody waits for a device that is gone.
+static void DX_USB_ActiveServoClass_InterfaceDeInit_FailCmds(
+		USBH_HandleTypeDef *phost) {
+	DX_ActiveServoClass_HandleTypeDef *handle =
+			(DX_ActiveServoClass_HandleTypeDef*) phost->pActiveClass->pData;
+
+	if (handle->state == DX__ETH2USB__ACTIVE_SERVO_CLASS_STATE__WRITING
+			|| handle->state == DX__ETH2USB__ACTIVE_SERVO_CLASS_STATE__READING)
+		DX_USB_ActiveServoClass_CompleteCmd(phost, DX__ACTIVE_SERVO_CLASS__ERR,
+				0U);
+
+	if (handle->hasNextCmd) {
+		handle->cmd = handle->nextCmd;
+		handle->hasNextCmd = false;
+
+		DX_USB_ActiveServoClass_CompleteCmd(phost, DX__ACTIVE_SERVO_CLASS__ERR,
+				0U);
+	}
+
+	if (handle->cmdMsgQueueId == NULL)
+		return;
+
+	while (osMessageQueueGet(handle->cmdMsgQueueId, &handle->cmd, NULL, 0U)
+			== osOK)
+		DX_USB_ActiveServoClass_CompleteCmd(phost, DX__ACTIVE_SERVO_CLASS__ERR,
+				0U);
+}
+
 static USBH_StatusTypeDef DX_USB_ActiveServoClass_InterfaceDeInit(
 		USBH_HandleTypeDef *phost) {
 	DX_ActiveServoClass_HandleTypeDef *handle =
 			(DX_ActiveServoClass_HandleTypeDef*) phost->pActiveClass->pData;
 	USBH_StatusTypeDef status = USBH_OK;
-	osStatus_t osStatus = osOK;
 
 	// Doing this instead of the way being done in the MSC example.
 	//  Basically, the one in the example, can cause UB.
 	if (handle == NULL)
 		return USBH_OK;
 
+	// No command gets submitted after this, so none gets stranded in the queue.
+	DX_USB_ActiveServoClass_SetAttached(phost, false);
+	DX_USB_ActiveServoClass_InterfaceDeInit_FailCmds(phost);
+
 	// Closes the output pipe if it's opened.
 	if ((handle->outPipeNo) != 0U) {
 		status = USBH_ClosePipe(phost, handle->outPipeNo);
@@ -205,35 +482,24 @@ static USBH_StatusTypeDef DX_USB_ActiveServoClass_InterfaceDeInit(
 		handle->inPipeNo = 0U;
 	}
 
-	// Frees the availability mutex if there.
-	if (handle->availabilityMutexId != NULL) {
-		osStatus = osMutexDelete(handle->availabilityMutexId);
-		if (osStatus != osOK) {
-			mlog("Failed to free the availability mutex");
+	// Closes the interrupt pipe if it's opened.
+	if ((handle->intPipeNo) != 0U) {
+		status = USBH_ClosePipe(phost, handle->intPipeNo);
+		if (status != USBH_OK) {
+			mlog("Failed to close interrupt pipe");
 			return USBH_FAIL;
 		}
-	}
 
-	// Frees the command message queue if it's created.
-	if (handle->cmdMsgQueueId != NULL) {
-		osStatus = osMessageQueueDelete(handle->cmdMsgQueueId);
-		if (osStatus != osOK) {
-			mlog("Failed to free command message queue");
+		status = USBH_FreePipe(phost, handle->intPipeNo);
+		if (status != USBH_OK) {
+			mlog("Failed to free interrupt pipe");
 			return USBH_FAIL;
 		}
-	}
 
-	// Frees the response message queue if it's created.
-	if (handle->rspMsgQueueId != NULL) {
-		osStatus = osMessageQueueDelete(handle->rspMsgQueueId);
-		if (osStatus != osOK) {
-			mlog("Failed to free response message queue");
-			return USBH_FAIL;
-		}
+		handle->intPipeNo = 0U;
 	}
 
-	// Frees the handle.
-	USBH_free(phost->pActiveClass->pData);
+	// Lets go of the handle, it keeps its mutex and message queues for the next attach.
 	phost->pActiveClass->pData = NULL;
 
 	return USBH_OK;
@@ -260,6 +526,7 @@ static USBH_StatusTypeDef DX_USB_ActiveServoClass_Process_PerformCurrentEntry(US
 		status = DX_USB_ActiveServoClass_ReadingState_Entry(phost);
 		break;
 	case DX__ETH2USB__ACTIVE_SERVO_CLASS_STATE__ERROR:
+		status = DX_USB_ActiveServoClass_ErrorState_Entry(phost);
 		break;
 	}
 
@@ -282,6 +549,7 @@ static USBH_StatusTypeDef DX_USB_ActiveServoClass_Process_PerformCurrentDo(USBH_
 		status = DX_USB_ActiveServoClass_ReadingState_Do(phost);
 		break;
 	case DX__ETH2USB__ACTIVE_SERVO_CLASS_STATE__ERROR:
+		status = DX_USB_ActiveServoClass_ErrorState_Do(phost);
 		break;
 	}
 
@@ -304,6 +572,7 @@ static USBH_StatusTypeDef DX_USB_ActiveServoClass_Process_PerformCurrentExit(USB
 		status = DX_USB_ActiveServoClass_ReadingState_Exit(phost);
 		break;
 	case DX__ETH2USB__ACTIVE_SERVO_CLASS_STATE__ERROR:
+		status = DX_USB_ActiveServoClass_ErrorState_Exit(phost);
 		break;
 	}
 
@@ -331,10 +600,85 @@ static USBH_StatusTypeDef DX_USB_ActiveServoClass_Process_PerformStateTransition
 	return status;
 }
 
+/// Hands a received telemetry report to the subscriber of the device, and starts the next
+///  poll of the interrupt IN end-point once it's due. The pipe is independent of the one
+///  commands use, so this doesn't care about the state machine.
+static void DX_USB_ActiveServoClass_Process_Telemetry(USBH_HandleTypeDef *phost) {
+	DX_ActiveServoClass_HandleTypeDef *handle =
+			(DX_ActiveServoClass_HandleTypeDef*) phost->pActiveClass->pData;
+	DX_ActiveServoClass_TelemetryState_t *state = &handle->telemetryState;
+	DX_ActiveServoClass_DmaBuffers_TypeDef *buffers = DX_USB_ActiveServoClass_DmaBuffers(phost);
+	DX_ActiveServoClass_TelemetrySubscriber_TypeDef *subscriber =
+			&gDxActiveServoClassTelemetrySubscribers[DX_USB_ActiveServoClass_DeviceNo(phost)];
+	uint16_t length = 0U;
+
+	if (handle->intPipeNo == 0U)
+		return;
+
+	if (state->reading) {
+		switch (USBH_LL_GetURBState(phost, handle->intPipeNo)) {
+		case USBH_URB_DONE:
+			// The buffer lives in the non-cacheable window, so it can be read as is.
+			length = (uint16_t) USBH_LL_GetLastXferSize(phost, handle->intPipeNo);
+			if (length > sizeof(buffers->telemetry))
+				length = sizeof(buffers->telemetry);
+
+			if (length > 0U && subscriber->callback != NULL)
+				subscriber->callback(subscriber->arg, buffers->telemetry, length);
+
+			state->reading = false;
+			break;
+		case USBH_URB_NOTREADY:
+			// NAKed, the servo had nothing to report.
+		case USBH_URB_ERROR:
+		case USBH_URB_STALL:
+			state->reading = false;
+			break;
+		default:
+			return;
+		}
+	}
+
+	if ((phost->Timer - state->lastPollTimer) < handle->intPollInterval)
+		return;
+
+	length = handle->intEpMaxPktSize;
+	if (length > sizeof(buffers->telemetry))
+		length = sizeof(buffers->telemetry);
+
+	state->lastPollTimer = phost->Timer;
+	state->pollDue = false;
+
+	if (USBH_InterruptReceiveData(phost, buffers->telemetry, (uint8_t) length,
+			handle->intPipeNo) == USBH_OK)
+		state->reading = true;
+}
+
+/// Fails the current command once it's past its deadline, the transfer it waits for might
+///  never complete since the HAL retries NAKed IN transfers forever.
+static void DX_USB_ActiveServoClass_Process_CheckDeadline(USBH_HandleTypeDef *phost) {
+	DX_ActiveServoClass_HandleTypeDef *handle =
+			(DX_ActiveServoClass_HandleTypeDef*) phost->pActiveClass->pData;
+
+	if (handle->state != DX__ETH2USB__ACTIVE_SERVO_CLASS_STATE__WRITING
+			&& handle->state != DX__ETH2USB__ACTIVE_SERVO_CLASS_STATE__READING)
+		return;
+
+	if (handle->nextState != handle->state
+			|| (int32_t) (phost->Timer - handle->deadline) < 0)
+		return;
+
+	mlog("Command timed out");
+
+	handle->nextState = DX__ETH2USB__ACTIVE_SERVO_CLASS_STATE__ERROR;
+}
+
 static USBH_StatusTypeDef DX_USB_ActiveServoClass_Process(
 		USBH_HandleTypeDef *phost) {
 	DX_ActiveServoClass_HandleTypeDef *handle =
 			(DX_ActiveServoClass_HandleTypeDef*) phost->pActiveClass->pData;
+	DX_ActiveServoClass_ReadySubscriber_TypeDef *ready =
+			&gDxActiveServoClassReadySubscribers[DX_USB_ActiveServoClass_DeviceNo(phost)];
 
 	USBH_StatusTypeDef status = USBH_OK;
 
@@ -347,18 +691,32 @@ static USBH_StatusTypeDef DX_USB_ActiveServoClass_Process(
 
 		status = DX_USB_ActiveServoClass_Process_PerformCurrentEntry(phost);
 
+		if (ready->callback != NULL)
+			ready->callback(ready->arg);
+
 		return status;
 	}
 
-	// Performs the state transition if needed.
-	status = DX_USB_ActiveServoClass_Process_PerformStateTransition(phost);
-	if (status != USBH_OK)
-		return status;
+	DX_USB_ActiveServoClass_Process_Telemetry(phost);
+	DX_USB_ActiveServoClass_Process_CheckDeadline(phost);
 
-	// Performs the do of the current state.
-	status = DX_USB_ActiveServoClass_Process_PerformCurrentDo(phost);
-	if (status != USBH_OK)
-		return status;
+	// Keeps going until the state machine waits for either a transfer or a command, we
+	//  get called again on the URB change notification or the submission of a command.
+	do {
+		// Performs the state transition if needed.
+		status = DX_USB_ActiveServoClass_Process_PerformStateTransition(phost);
+		if (status != USBH_OK)
+			return status;
+
+		// Performs the do of the current state.
+		status = DX_USB_ActiveServoClass_Process_PerformCurrentDo(phost);
+		if (status != USBH_OK)
+			return status;
+	} while (handle->nextState != handle->state);
+
+	// A retry might have taken the wake-up over, the deadline still has to be noticed.
+	if (handle->state != DX__ETH2USB__ACTIVE_SERVO_CLASS_STATE__IDLE)
+		DX_USB_ActiveServoClass_WakeAt(phost, handle->deadline);
 
 	return status;
 }
@@ -368,53 +726,319 @@ static USBH_StatusTypeDef DX_USB_ActiveServoClass_ClassRequest(
 	return USBH_OK;
 }
 
+/// Wakes the USB host thread once the wake-up requested by the states is due.
+static void DX_USB_ActiveServoClass_SOFProcess_Wake(USBH_HandleTypeDef *phost) {
+	DX_ActiveServoClass_HandleTypeDef *handle =
+			(DX_ActiveServoClass_HandleTypeDef*) phost->pActiveClass->pData;
+	uint32_t msg = (uint32_t) USBH_CLASS_EVENT;
+
+	if (!handle->wakeArmed || (int32_t) (phost->Timer - handle->wakeTimer) < 0)
+		return;
+
+	// Tried again on the next SOF if the event queue is full.
+	if (osMessageQueuePut(phost->os_event, &msg, 0U, 0U) == osOK)
+		handle->wakeArmed = false;
+}
+
+/// Gets called from the SOF interrupt, it only wakes the USB host thread once a telemetry
+///  poll, a retry or a deadline is due.
 static USBH_StatusTypeDef DX_USB_ActiveServoClass_SOFProcess(
 		USBH_HandleTypeDef *phost) {
-	// We don't need to do anything periodically.
+	DX_ActiveServoClass_HandleTypeDef *handle =
+			(DX_ActiveServoClass_HandleTypeDef*) phost->pActiveClass->pData;
+	DX_ActiveServoClass_TelemetryState_t *state = NULL;
+	uint32_t msg = (uint32_t) USBH_CLASS_EVENT;
+
+	if (handle == NULL)
+		return USBH_OK;
+
+	DX_USB_ActiveServoClass_SOFProcess_Wake(phost);
+
+	if (handle->intPipeNo == 0U)
+		return USBH_OK;
+
+	state = &handle->telemetryState;
+
+	if (state->reading || state->pollDue
+			|| (phost->Timer - state->lastPollTimer) < handle->intPollInterval)
+		return USBH_OK;
+
+	// Tried again on the next SOF if the event queue is full.
+	if (osMessageQueuePut(phost->os_event, &msg, 0U, 0U) == osOK)
+		state->pollDue = true;
+
 	return USBH_OK;
 }
 
-DX_ActiveServoClass_StatusTypeDef DX_ActiveServoClass_Cmd(
-		USBH_HandleTypeDef *phost, uint8_t *out, uint8_t *in) {
+void DX_USB_ActiveServoClass_WakeAt(USBH_HandleTypeDef *phost, uint32_t timer) {
+	DX_ActiveServoClass_HandleTypeDef *handle =
+			(DX_ActiveServoClass_HandleTypeDef*) phost->pActiveClass->pData;
+
+	if (handle->wakeArmed && (int32_t) (timer - handle->wakeTimer) >= 0)
+		return;
+
+	// Disarmed while updating, so the SOF interrupt never sees a half written wake-up.
+	handle->wakeArmed = false;
+	handle->wakeTimer = timer;
+	handle->wakeArmed = true;
+}
+
+void DX_ActiveServoClass_SetReadyCallback(uint8_t deviceNo,
+		DX_ActiveServoClass_ReadyCallback_TypeDef callback, void *arg) {
+	DX_ActiveServoClass_ReadySubscriber_TypeDef *subscriber =
+			&gDxActiveServoClassReadySubscribers[deviceNo];
+
+	subscriber->callback = callback;
+	subscriber->arg = arg;
+}
+
+void DX_ActiveServoClass_SetTelemetryCallback(uint8_t deviceNo,
+		DX_ActiveServoClass_TelemetryCallback_TypeDef callback, void *arg) {
+	DX_ActiveServoClass_TelemetrySubscriber_TypeDef *subscriber =
+			&gDxActiveServoClassTelemetrySubscribers[deviceNo];
+
+	subscriber->callback = callback;
+	subscriber->arg = arg;
+}
+
+void DX_USB_ActiveServoClass_CompleteCmd(USBH_HandleTypeDef *phost,
+		DX_ActiveServoClass_StatusTypeDef status, uint16_t inLength) {
 	DX_ActiveServoClass_HandleTypeDef *handle =
 			(DX_ActiveServoClass_HandleTypeDef*) phost->pActiveClass->pData;
+	DX_ActiveServoClass_Rsp_TypeDef rsp;
+
+	rsp.status = status;
+	rsp.inLength = inLength;
+	rsp.outSubmittedTimestamp = DX__ETH2USB__TIMESTAMP__NONE;
+	rsp.outDoneTimestamp = DX__ETH2USB__TIMESTAMP__NONE;
+	rsp.inDoneTimestamp = DX__ETH2USB__TIMESTAMP__NONE;
+
+	if (status == DX__ACTIVE_SERVO_CLASS__OK) {
+		rsp.outSubmittedTimestamp = handle->outSubmittedTimestamp;
+		rsp.outDoneTimestamp = handle->outDoneTimestamp;
+
+		if (handle->cmd.in != NULL)
+			rsp.inDoneTimestamp = DX_ETH2USB_Timestamp_Now();
+	}
+
+	if (handle->cmd.callback != NULL)
+		handle->cmd.callback(handle->cmd.arg, &rsp);
+}
+
+#ifdef DX_ETH2USB__USB__DMA
+/// Whether the OTG DMA can reach the buffer, it has no path into the DTCM.
+static bool DX_USB_ActiveServoClass_IsDmaReachable(const uint8_t *buffer) {
+	uint32_t addr = (uint32_t) buffer;
+
+	return addr < D1_DTCMRAM_BASE
+			|| addr >= D1_DTCMRAM_BASE + DX_USB_ACTIVE_SERVO_CLASS__DTCM_SIZE;
+}
+
+/// Gets the cache line aligned address range that covers the given buffer.
+static void DX_USB_ActiveServoClass_CacheLines(const uint8_t *buffer,
+		uint16_t length, uint32_t **addr, int32_t *size) {
+	uint32_t start = ((uint32_t) buffer)
+			& ~(DX_USB_ACTIVE_SERVO_CLASS__CACHE_LINE_SIZE - 1U);
+	uint32_t end = ((uint32_t) buffer) + length;
+
+	*addr = (uint32_t*) start;
+	*size = (int32_t) (end - start);
+}
+
+/// Whether the DMA can receive into the buffer of the command as is. The core writes
+///  whole packets, and invalidating the buffer must not drop anything the CPU wrote
+///  next to it, so it has to cover whole cache lines and whole packets.
+static bool DX_USB_ActiveServoClass_IsDirectIn(DX_ActiveServoClass_HandleTypeDef *handle,
+		const DX_ActiveServoClass_Cmd_TypeDef *cmd) {
+	return DX_USB_ActiveServoClass_IsDmaReachable(cmd->in)
+			&& (((uint32_t) cmd->in) % DX_USB_ACTIVE_SERVO_CLASS__CACHE_LINE_SIZE) == 0U
+			&& (cmd->inLength % DX_USB_ACTIVE_SERVO_CLASS__CACHE_LINE_SIZE) == 0U
+			&& (cmd->inLength % handle->inEpMaxPktSize) == 0U;
+}
+#endif
+
+uint8_t* DX_USB_ActiveServoClass_DmaOut(USBH_HandleTypeDef *phost, uint8_t *out,
+		uint16_t length) {
+#ifdef DX_ETH2USB__USB__DMA
+	DX_ActiveServoClass_DmaBuffers_TypeDef *buffers = DX_USB_ActiveServoClass_DmaBuffers(phost);
+	uint32_t *addr = NULL;
+	int32_t size = 0;
+
+	// The DMA reads words outside the DTCM, anything else gets copied into the
+	//  non-cacheable window.
+	if (!DX_USB_ActiveServoClass_IsDmaReachable(out) || (((uint32_t) out) % 4U) != 0U) {
+		memcpy(buffers->out, out, length);
+		return buffers->out;
+	}
+
+	DX_USB_ActiveServoClass_CacheLines(out, length, &addr, &size);
+	SCB_CleanDCache_by_Addr(addr, size);
+#endif
+
+	return out;
+}
+
+uint8_t* DX_USB_ActiveServoClass_DmaIn(USBH_HandleTypeDef *phost,
+		const DX_ActiveServoClass_Cmd_TypeDef *cmd, uint16_t *length) {
+#ifdef DX_ETH2USB__USB__DMA
+	DX_ActiveServoClass_HandleTypeDef *handle =
+			(DX_ActiveServoClass_HandleTypeDef*) phost->pActiveClass->pData;
+	DX_ActiveServoClass_DmaBuffers_TypeDef *buffers = DX_USB_ActiveServoClass_DmaBuffers(phost);
+	uint32_t *addr = NULL;
+	int32_t size = 0;
+
+	// The bounce buffer takes whole packets, so a servo can't overrun the command's buffer.
+	if (!DX_USB_ActiveServoClass_IsDirectIn(handle, cmd)) {
+		*length = cmd->inLength + handle->inEpMaxPktSize - 1U;
+		*length -= *length % handle->inEpMaxPktSize;
+
+		if (*length > sizeof(buffers->in))
+			*length = sizeof(buffers->in);
+
+		return buffers->in;
+	}
+
+	// Makes sure no dirty line gets evicted on top of what the DMA writes.
+	DX_USB_ActiveServoClass_CacheLines(cmd->in, cmd->inLength, &addr, &size);
+	SCB_CleanInvalidateDCache_by_Addr(addr, size);
+#endif
+
+	*length = cmd->inLength;
+
+	return cmd->in;
+}
+
+uint16_t DX_USB_ActiveServoClass_DmaInDone(USBH_HandleTypeDef *phost,
+		const DX_ActiveServoClass_Cmd_TypeDef *cmd, uint16_t inLength) {
+#ifdef DX_ETH2USB__USB__DMA
+	DX_ActiveServoClass_HandleTypeDef *handle =
+			(DX_ActiveServoClass_HandleTypeDef*) phost->pActiveClass->pData;
+	DX_ActiveServoClass_DmaBuffers_TypeDef *buffers = DX_USB_ActiveServoClass_DmaBuffers(phost);
+	uint32_t *addr = NULL;
+	int32_t size = 0;
+
+	if (!DX_USB_ActiveServoClass_IsDirectIn(handle, cmd)) {
+		if (inLength > cmd->inLength)
+			inLength = cmd->inLength;
+
+		memcpy(cmd->in, buffers->in, inLength);
+
+		return inLength;
+	}
+
+	// Drops whatever got speculatively read into the cache while the DMA was writing.
+	DX_USB_ActiveServoClass_CacheLines(cmd->in, cmd->inLength, &addr, &size);
+	SCB_InvalidateDCache_by_Addr(addr, size);
+#else
+	(void) phost;
+#endif
+
+	return inLength > cmd->inLength ? cmd->inLength : inLength;
+}
+
+DX_ActiveServoClass_StatusTypeDef DX_ActiveServoClass_Submit(
+		USBH_HandleTypeDef *phost, const DX_ActiveServoClass_Cmd_TypeDef *cmd) {
+	USBH_ClassTypeDef *activeClass = phost->pActiveClass;
+	DX_ActiveServoClass_Attachment_TypeDef *attachment = NULL;
+	DX_ActiveServoClass_HandleTypeDef *handle = NULL;
+	DX_ActiveServoClass_StatusTypeDef status = DX__ACTIVE_SERVO_CLASS__OK;
+	uint32_t msg = (uint32_t) USBH_CLASS_EVENT;
+	osStatus_t osStatus = osOK;
+
+	if (activeClass == NULL) {
+		mlog("Cannot submit command without an active device");
+		return DX__ACTIVE_SERVO_CLASS__ERR;
+	}
+
+	attachment = &gDxActiveServoClassAttachments[activeClass - gDxActiveServoClass];
+	handle = &gDxActiveServoClassHandles[activeClass - gDxActiveServoClass];
+
+	if (attachment->mutexId == NULL) {
+		mlog("Cannot submit command to a device that never got attached");
+		return DX__ACTIVE_SERVO_CLASS__ERR;
+	}
+
+	// Holding the mutex keeps the device from being detached, and thus its queue from
+	//  being drained, until the command is in it.
+	osStatus = osMutexAcquire(attachment->mutexId,
+			DX_ETH2USB__ACTIVE_SERVO_CLASS__SUBMIT_TIMEOUT);
+	if (osStatus != osOK) {
+		mlog("Failed to acquire the attachment mutex, status: %d", osStatus);
+		return DX__ACTIVE_SERVO_CLASS__ERR;
+	}
+
+	if (!attachment->attached) {
+		mlog("Cannot submit command without an active device");
+		status = DX__ACTIVE_SERVO_CLASS__ERR;
+	} else {
+		osStatus = osMessageQueuePut(handle->cmdMsgQueueId, cmd, 0U,
+				DX_ETH2USB__ACTIVE_SERVO_CLASS__SUBMIT_TIMEOUT);
+		if (osStatus != osOK) {
+			mlog("Failed to put command inside message queue, status: %d", osStatus);
+			status = DX__ACTIVE_SERVO_CLASS__ERR;
+		} else {
+			// Wakes the USB host thread once, from then on the URB change notifications
+			//  keep the state machine going.
+			(void) osMessageQueuePut(phost->os_event, &msg, 0U, 0U);
+		}
+	}
+
+	if (osMutexRelease(attachment->mutexId) != osOK)
+		Error_Handler();
+
+	return status;
+}
+
+/// Completion callback of synchronous commands, passes the response on to the waiting
+///  caller.
+static void DX_ActiveServoClass_Cmd_HandleCompletion(void *arg,
+		const DX_ActiveServoClass_Rsp_TypeDef *rsp) {
+	DX_ActiveServoClass_HandleTypeDef *handle = arg;
+
+	(void) osMessageQueuePut(handle->rspMsgQueueId, rsp, 0U, 0U);
+}
+
+DX_ActiveServoClass_StatusTypeDef DX_ActiveServoClass_Cmd(
+		USBH_HandleTypeDef *phost, uint8_t *out, uint16_t outLength, uint8_t *in,
+		uint16_t inLength, uint16_t *inLengthRead) {
+	DX_ActiveServoClass_HandleTypeDef *handle = NULL;
 	DX_ActiveServoClass_Cmd_TypeDef cmd;
 	DX_ActiveServoClass_Rsp_TypeDef rsp;
 	osStatus_t osStatus = osOK;
 
+	if (phost->pActiveClass == NULL || phost->pActiveClass->pData == NULL)
+		return DX__ACTIVE_SERVO_CLASS__ERR;
+
+	handle = (DX_ActiveServoClass_HandleTypeDef*) phost->pActiveClass->pData;
+
 	cmd.out = out;
+	cmd.outLength = outLength;
 	cmd.in = in;
+	cmd.inLength = inLength;
+	cmd.callback = DX_ActiveServoClass_Cmd_HandleCompletion;
+	cmd.arg = handle;
+	cmd.timeout = 0U;
 
-	mlog("Acquiring availability mutex");
+	// There's a single response queue, so synchronous callers take turns.
 	osStatus = osMutexAcquire(handle->availabilityMutexId, osWaitForever);
 	if (osStatus != osOK) {
 		USBH_DbgLog("Failed to acquire the availability mutex");
 		return DX__ACTIVE_SERVO_CLASS__ERR;
 	}
-	mlog("Acquired availability mutex");
 
-	mlog("Putting command in message queue");
-	osStatus = osMessageQueuePut(handle->cmdMsgQueueId, &cmd, 0U,
-			osWaitForever);
-	if (osStatus != osOK) {
-		USBH_DbgLog("Failed to put command inside message queue");
+	if (DX_ActiveServoClass_Submit(phost, &cmd) != DX__ACTIVE_SERVO_CLASS__OK) {
+		(void) osMutexRelease(handle->availabilityMutexId);
 		return DX__ACTIVE_SERVO_CLASS__ERR;
 	}
-	mlog("Put command in message queue");
 
-		while (osMessageQueueGetCount(handle->rspMsgQueueId) == 0) {
-		  phost->os_msg = (uint32_t)USBH_CLASS_EVENT;
-		  (void)osMessageQueuePut(phost->os_event, &phost->os_msg, 0U, 0U);
-		}
-
-	mlog("Waiting for response");
+	// The command either completes, times out or fails when the device goes away, so this
+	//  doesn't wait forever.
 	osStatus = osMessageQueueGet(handle->rspMsgQueueId, &rsp, 0U,
 			osWaitForever);
 	if (osStatus != osOK) {
 		USBH_DbgLog("Failed to get response from message queue");
 		return DX__ACTIVE_SERVO_CLASS__ERR;
 	}
-	mlog("Received response");
 
 	osStatus = osMutexRelease(handle->availabilityMutexId);
 	if (osStatus != osOK) {
@@ -422,6 +1046,8 @@ DX_ActiveServoClass_StatusTypeDef DX_ActiveServoClass_Cmd(
 		return DX__ACTIVE_SERVO_CLASS__ERR;
 	}
 
+	if (inLengthRead != NULL)
+		*inLengthRead = rsp.inLength;
+
 	return rsp.status;
 }
-
@@ -0,0 +1,131 @@
+/*
+ * error.c
+ *
+ *  Created on: Oct 17, 2026
+ */
+
+#include "dx/eth2usb/active_servo_class.h"
+#include "dx/eth2usb/active_servo_class_states/error.h"
+#include "logging.h"
+#include "settings.h"
+
+/// Stops whatever transfer the given pipe is busy with, and sets it up again from scratch.
+static USBH_StatusTypeDef DX_USB_ActiveServoClass_ErrorState_ResetPipe(USBH_HandleTypeDef *phost,
+		uint8_t pipeNo, uint8_t epAddr, uint16_t epMaxPktSize)
+{
+	USBH_StatusTypeDef usbhStatus = USBH_OK;
+
+	usbhStatus = USBH_ClosePipe(phost, pipeNo);
+	if (usbhStatus != USBH_OK) {
+		mlog("Failed to halt pipe %u, USB host status: %d", pipeNo, usbhStatus);
+		return USBH_FAIL;
+	}
+
+	usbhStatus = USBH_OpenPipe(phost, pipeNo, epAddr, phost->device.address,
+			phost->device.speed, USB_EP_TYPE_BULK, epMaxPktSize);
+	if (usbhStatus != USBH_OK) {
+		mlog("Failed to reopen pipe %u, USB host status: %d", pipeNo, usbhStatus);
+		return USBH_FAIL;
+	}
+
+	return USBH_OK;
+}
+
+USBH_StatusTypeDef DX_USB_ActiveServoClass_ErrorState_Entry(USBH_HandleTypeDef *phost)
+{
+	DX_ActiveServoClass_HandleTypeDef *handle =
+			(DX_ActiveServoClass_HandleTypeDef*) phost->pActiveClass->pData;
+	DX_ActiveServoClass_ErrorState_t *errorState = &handle->errorState;
+
+	USBH_StatusTypeDef usbhStatus = USBH_OK;
+
+	mlog("Entering error state");
+
+	// Whoever waits for the command gets an error right away, recovering takes a while.
+	DX_USB_ActiveServoClass_CompleteCmd(phost, DX__ACTIVE_SERVO_CLASS__ERR, 0U);
+
+	// The OUT transfer of the next command might have been started already, it went down
+	//  together with the current one.
+	if (handle->hasNextCmd) {
+		handle->cmd = handle->nextCmd;
+		handle->hasNextCmd = false;
+
+		DX_USB_ActiveServoClass_CompleteCmd(phost, DX__ACTIVE_SERVO_CLASS__ERR, 0U);
+	}
+
+	handle->inPrearmed = false;
+
+	usbhStatus = DX_USB_ActiveServoClass_ErrorState_ResetPipe(phost, handle->outPipeNo,
+			handle->outEpAddr, handle->outEpMaxPktSize);
+	if (usbhStatus != USBH_OK)
+		return usbhStatus;
+
+	usbhStatus = DX_USB_ActiveServoClass_ErrorState_ResetPipe(phost, handle->inPipeNo,
+			handle->inEpAddr, handle->inEpMaxPktSize);
+	if (usbhStatus != USBH_OK)
+		return usbhStatus;
+
+	errorState->step = DX__ACTIVE_SERVO_CLASS__ERROR_STEP__CLEAR_OUT;
+
+	// A servo that doesn't answer the control requests either must not keep the submitted
+	//  commands waiting forever.
+	handle->deadline = phost->Timer + DX_ETH2USB__ACTIVE_SERVO_CLASS__RECOVERY_TIMEOUT;
+
+	return usbhStatus;
+}
+
+USBH_StatusTypeDef DX_USB_ActiveServoClass_ErrorState_Do(USBH_HandleTypeDef *phost)
+{
+	DX_ActiveServoClass_HandleTypeDef *handle =
+			(DX_ActiveServoClass_HandleTypeDef*) phost->pActiveClass->pData;
+	DX_ActiveServoClass_ErrorState_t *errorState = &handle->errorState;
+
+	USBH_StatusTypeDef usbhStatus = USBH_OK;
+
+	if ((int32_t) (phost->Timer - handle->deadline) >= 0) {
+		mlog("Giving up on clearing the halt of the end-points");
+
+		handle->nextState = DX__ETH2USB__ACTIVE_SERVO_CLASS_STATE__IDLE;
+
+		return USBH_OK;
+	}
+
+	// Clears the halt of the end-points, which also resets their data toggles.
+	switch (errorState->step) {
+	case DX__ACTIVE_SERVO_CLASS__ERROR_STEP__CLEAR_OUT:
+		usbhStatus = USBH_ClrFeature(phost, handle->outEpAddr);
+		break;
+	case DX__ACTIVE_SERVO_CLASS__ERROR_STEP__CLEAR_IN:
+		usbhStatus = USBH_ClrFeature(phost, handle->inEpAddr);
+		break;
+	default:
+		break;
+	}
+
+	// The control transfer is still going, its URB change notifications get us called again.
+	if (usbhStatus == USBH_BUSY)
+		return USBH_OK;
+
+	if (usbhStatus != USBH_OK)
+		mlog("Failed to clear the halt of an end-point, USB host status: %d", usbhStatus);
+
+	if (++errorState->step < DX__ACTIVE_SERVO_CLASS__ERROR_STEP__DONE)
+		return USBH_OK;
+
+	mlog("Recovered from error");
+
+	USBH_LL_SetToggle(phost, handle->outPipeNo, 0U);
+
+	handle->nextState = DX__ETH2USB__ACTIVE_SERVO_CLASS_STATE__IDLE;
+
+	return USBH_OK;
+}
+
+USBH_StatusTypeDef DX_USB_ActiveServoClass_ErrorState_Exit(USBH_HandleTypeDef *phost)
+{
+	USBH_StatusTypeDef status = USBH_OK;
+
+	mlog("Exiting error state");
+
+	return status;
+}
@@ -5,11 +5,59 @@
  *      Author: luke
  */
 
-#include <string.h>
-
 #include "dx/eth2usb/active_servo_class.h"
+#include "dx/eth2usb/active_servo_class_states/reading.h"
 #include "dx/eth2usb/active_servo_class_states/writing.h"
+#include "dx/eth2usb/timestamp.h"
 #include "logging.h"
+#include "settings.h"
+
+/// Starts the IN transfer of the current command, the buffer isn't cleared since the
+///  actual length gets reported on completion.
+USBH_StatusTypeDef DX_USB_ActiveServoClass_ReadingState_Arm(USBH_HandleTypeDef *phost)
+{
+	DX_ActiveServoClass_HandleTypeDef *handle =
+			(DX_ActiveServoClass_HandleTypeDef*) phost->pActiveClass->pData;
+
+	USBH_StatusTypeDef usbhStatus = USBH_OK;
+	uint16_t length = 0U;
+	uint8_t *buffer = DX_USB_ActiveServoClass_DmaIn(phost, &handle->cmd, &length);
+
+	// The transfer ends with the first short or zero length packet, or once the buffer is full.
+	USBH_LL_SetToggle(phost, handle->inPipeNo, 1U);
+	usbhStatus = USBH_BulkReceiveData(phost, buffer, length, handle->inPipeNo);
+
+	mlog("Reading bulk data");
+
+	if (usbhStatus != USBH_OK) {
+		mlog("Failed to read bulk data, USB host status: %d", usbhStatus);
+
+		usbhStatus = USBH_FAIL;
+	}
+
+	return usbhStatus;
+}
+
+#ifdef DX_ETH2USB__ACTIVE_SERVO_CLASS__PREARM_IN
+/// Starts the OUT transfer of the next submitted command while the response of the
+///  current one is still outstanding, the OUT pipe is idle once in the reading state.
+static void DX_USB_ActiveServoClass_ReadingState_Do_SendNext(USBH_HandleTypeDef *phost)
+{
+	DX_ActiveServoClass_HandleTypeDef *handle =
+			(DX_ActiveServoClass_HandleTypeDef*) phost->pActiveClass->pData;
+
+	if (handle->hasNextCmd)
+		return;
+
+	if (osMessageQueueGet(handle->cmdMsgQueueId, &handle->nextCmd, 0U, 0U) != osOK)
+		return;
+
+	handle->nextOutSubmittedTimestamp = DX_ETH2USB_Timestamp_Now();
+	DX_USB_ActiveServoClass_WritingState_Send(phost, &handle->nextCmd, 0U);
+
+	handle->hasNextCmd = true;
+}
+#endif
 
 USBH_StatusTypeDef DX_USB_ActiveServoClass_ReadingState_Entry(USBH_HandleTypeDef *phost)
 {
@@ -21,7 +69,8 @@ USBH_StatusTypeDef DX_USB_ActiveServoClass_ReadingState_Entry(USBH_HandleTypeDef
 
 	mlog("Entering reading state");
 
-	readingState->reading = false;
+	readingState->reading = handle->inPrearmed;
+	handle->inPrearmed = false;
 
 	return usbhStatus;
 
@@ -31,16 +80,22 @@ USBH_StatusTypeDef DX_USB_ActiveServoClass_ReadingState_Do_HandleDone(USBH_Handl
 {
 	DX_ActiveServoClass_HandleTypeDef *handle =
 			(DX_ActiveServoClass_HandleTypeDef*) phost->pActiveClass->pData;
-	DX_ActiveServoClass_Rsp_TypeDef rsp;
 
 	USBH_StatusTypeDef usbhStatus = USBH_OK;
+	uint16_t inLength = 0U;
 
 	mlog("USB host finished reading");
 
-	rsp.status = DX__ACTIVE_SERVO_CLASS__OK;
-	osMessageQueuePut(handle->rspMsgQueueId, &rsp, 0U, 0U);
+	inLength = (uint16_t) USBH_LL_GetLastXferSize(phost, handle->inPipeNo);
+
+	inLength = DX_USB_ActiveServoClass_DmaInDone(phost, &handle->cmd, inLength);
 
-	handle->nextState = DX__ETH2USB__ACTIVE_SERVO_CLASS_STATE__IDLE;
+	DX_USB_ActiveServoClass_CompleteCmd(phost, DX__ACTIVE_SERVO_CLASS__OK, inLength);
+
+	// The next command is already being written if it got sent while reading.
+	handle->nextState = handle->hasNextCmd ?
+			DX__ETH2USB__ACTIVE_SERVO_CLASS_STATE__WRITING :
+			DX__ETH2USB__ACTIVE_SERVO_CLASS_STATE__IDLE;
 
 	return usbhStatus;
 }
@@ -65,27 +120,26 @@ USBH_StatusTypeDef DX_USB_ActiveServoClass_ReadingState_Do(USBH_HandleTypeDef *p
 		{
 			mlog("USB host got stall condition reported");
 
-			handle->state = DX__ETH2USB__ACTIVE_SERVO_CLASS_STATE__ERROR;
+			handle->nextState = DX__ETH2USB__ACTIVE_SERVO_CLASS_STATE__ERROR;
+
+			break;
+		}
+		case USBH_URB_ERROR:
+		{
+			mlog("USB host failed to read");
+
+			handle->nextState = DX__ETH2USB__ACTIVE_SERVO_CLASS_STATE__ERROR;
 
 			break;
 		}
 		default:
+#ifdef DX_ETH2USB__ACTIVE_SERVO_CLASS__PREARM_IN
+			DX_USB_ActiveServoClass_ReadingState_Do_SendNext(phost);
+#endif
 			break;
 		}
 	} else {
-		memset(handle->cmd.in, 0, handle->inEpMaxPktSize);
-
-		USBH_LL_SetToggle(phost, handle->inPipeNo, 1U);
-		usbhStatus = USBH_BulkReceiveData(phost, handle->cmd.in, handle->inEpMaxPktSize,
-				handle->inPipeNo);
-
-		mlog("Reading bulk data");
-
-		if (usbhStatus != USBH_OK) {
-			mlog("Failed to read bulk data, USB host status: %d", usbhStatus);
-
-			usbhStatus = USBH_FAIL;
-		}
+		usbhStatus = DX_USB_ActiveServoClass_ReadingState_Arm(phost);
 
 		readingState->reading = true;
 	}
@@ -7,8 +7,67 @@
 
 #include "logging.h"
 #include "dx/eth2usb/active_servo_class.h"
+#include "dx/eth2usb/active_servo_class_states/reading.h"
 #include "dx/eth2usb/active_servo_class_states/writing.h"
+#include "dx/eth2usb/timestamp.h"
 #include "logging.h"
+#include "settings.h"
+
+/// Gets the length of the chunk of the OUT data that starts at the given offset. A chunk is
+///  a single packet, since the HCD reports a NAK in the middle of a multi-packet transfer
+///  without saying how much of it got ACKed, so only a single packet can be resent safely.
+static uint16_t DX_USB_ActiveServoClass_WritingState_ChunkLength(
+		DX_ActiveServoClass_HandleTypeDef *handle, const DX_ActiveServoClass_Cmd_TypeDef *cmd,
+		uint16_t offset)
+{
+	uint16_t remaining = cmd->outLength - offset;
+
+	return remaining < handle->outEpMaxPktSize ? remaining : handle->outEpMaxPktSize;
+}
+
+/// Gets the number of frames to wait before writing a chunk again that got NAKed the given
+///  number of times in a row, zero for right away.
+static uint32_t DX_USB_ActiveServoClass_WritingState_Backoff(uint8_t nNaks)
+{
+	uint32_t backoff = 1U;
+
+	if (nNaks <= DX_ETH2USB__ACTIVE_SERVO_CLASS__NAK_RETRY_CNT)
+		return 0U;
+
+	for (nNaks -= DX_ETH2USB__ACTIVE_SERVO_CLASS__NAK_RETRY_CNT; nNaks > 1U; nNaks--) {
+		backoff <<= 1U;
+
+		if (backoff >= DX_ETH2USB__ACTIVE_SERVO_CLASS__MAX_NAK_BACKOFF)
+			return DX_ETH2USB__ACTIVE_SERVO_CLASS__MAX_NAK_BACKOFF;
+	}
+
+	return backoff;
+}
+
+/// Starts the OUT transfer of the chunk of the given command that starts at the given
+///  offset, at the end of the OUT data that's a zero length packet.
+USBH_StatusTypeDef DX_USB_ActiveServoClass_WritingState_Send(USBH_HandleTypeDef *phost,
+		DX_ActiveServoClass_Cmd_TypeDef *cmd, uint16_t offset)
+{
+	DX_ActiveServoClass_HandleTypeDef *handle =
+			(DX_ActiveServoClass_HandleTypeDef*) phost->pActiveClass->pData;
+
+	USBH_StatusTypeDef usbhStatus = USBH_OK;
+	uint16_t length = DX_USB_ActiveServoClass_WritingState_ChunkLength(handle, cmd, offset);
+	uint8_t *buffer = DX_USB_ActiveServoClass_DmaOut(phost, &cmd->out[offset], length);
+
+	usbhStatus = USBH_BulkSendData(phost, buffer, length, handle->outPipeNo, 1U);
+
+	mlog("Writing bulk data");
+
+	if (usbhStatus != USBH_OK) {
+		mlog("Failed to send bulk data, USB host status: %d", usbhStatus);
+
+		usbhStatus = USBH_FAIL;
+	}
+
+	return usbhStatus;
+}
 
 USBH_StatusTypeDef DX_USB_ActiveServoClass_WritingState_Entry(USBH_HandleTypeDef *phost)
 {
@@ -20,7 +79,38 @@ USBH_StatusTypeDef DX_USB_ActiveServoClass_WritingState_Entry(USBH_HandleTypeDef
 
 	mlog("Entering writing state");
 
-	writingState->written = false;
+	// The OUT transfer of the next command might have been started while reading.
+	writingState->written = handle->hasNextCmd;
+	writingState->offset = 0U;
+	writingState->nNaks = 0U;
+	writingState->backingOff = false;
+
+	handle->outSubmittedTimestamp = handle->hasNextCmd ?
+			handle->nextOutSubmittedTimestamp : DX__ETH2USB__TIMESTAMP__NONE;
+	handle->outDoneTimestamp = DX__ETH2USB__TIMESTAMP__NONE;
+
+	if (handle->hasNextCmd) {
+		handle->cmd = handle->nextCmd;
+		handle->hasNextCmd = false;
+	}
+
+	// A transfer that's longer than a packet and ends on a packet boundary is terminated
+	//  by a zero length packet, single packets are what servos expect without one.
+	writingState->zlpPending = handle->cmd.outLength > handle->outEpMaxPktSize
+			&& (handle->cmd.outLength % handle->outEpMaxPktSize) == 0U;
+
+	// Covers both the OUT and the IN transfer, a pre-sent command starts its time now too.
+	handle->deadline = phost->Timer + (handle->cmd.timeout != 0U ?
+			handle->cmd.timeout : DX_ETH2USB__ACTIVE_SERVO_CLASS__CMD_TIMEOUT);
+
+#ifdef DX_ETH2USB__ACTIVE_SERVO_CLASS__PREARM_IN
+	// Lets the response land as soon as the servo has it, without another wake cycle.
+	if (handle->cmd.in != NULL) {
+		usbhStatus = DX_USB_ActiveServoClass_ReadingState_Arm(phost);
+
+		handle->inPrearmed = true;
+	}
+#endif
 
 	return usbhStatus;
 }
@@ -40,13 +130,28 @@ USBH_StatusTypeDef DX_USB_ActiveServoClass_WritingState_Do(USBH_HandleTypeDef *p
 		switch (usbhUrbState) {
 		case USBH_URB_DONE:
 		{
+			writingState->nNaks = 0U;
+			writingState->offset += DX_USB_ActiveServoClass_WritingState_ChunkLength(handle,
+					&handle->cmd, writingState->offset);
+
+			if (writingState->offset < handle->cmd.outLength) {
+				writingState->written = false; // Writes the next chunk right away.
+				break;
+			}
+
+			if (writingState->zlpPending) {
+				writingState->zlpPending = false;
+				writingState->written = false; // Writes the zero length packet right away.
+				break;
+			}
+
 			mlog("USB host finished writing");
 
-			if (handle->cmd.in == NULL) {
-				DX_ActiveServoClass_Rsp_TypeDef rsp;
+			handle->outDoneTimestamp = DX_ETH2USB_Timestamp_Now();
 
-				rsp.status = DX__ACTIVE_SERVO_CLASS__OK;
-				osMessageQueuePut(handle->rspMsgQueueId, &rsp, 0U, 0U);
+			if (handle->cmd.in == NULL) {
+				DX_USB_ActiveServoClass_CompleteCmd(phost,
+						DX__ACTIVE_SERVO_CLASS__OK, 0U);
 
 				handle->nextState = DX__ETH2USB__ACTIVE_SERVO_CLASS_STATE__IDLE;
 			} else {
@@ -59,7 +164,15 @@ USBH_StatusTypeDef DX_USB_ActiveServoClass_WritingState_Do(USBH_HandleTypeDef *p
 		{
 			mlog("USB host was not ready to write, rewriting");
 
-			writingState->written = false; // Write again.
+			if (writingState->nNaks < UINT8_MAX)
+				writingState->nNaks++;
+
+			// Write again, the SOF interrupt wakes us once the backoff is over since no other
+			//  notification follows.
+			writingState->written = false;
+			writingState->backingOff = true;
+			writingState->retryTimer = phost->Timer
+					+ DX_USB_ActiveServoClass_WritingState_Backoff(writingState->nNaks);
 
 			break;
 		}
@@ -67,27 +180,43 @@ USBH_StatusTypeDef DX_USB_ActiveServoClass_WritingState_Do(USBH_HandleTypeDef *p
 		{
 			mlog("USB host got stall condition reported");
 
-			handle->state = DX__ETH2USB__ACTIVE_SERVO_CLASS_STATE__ERROR;
+			handle->nextState = DX__ETH2USB__ACTIVE_SERVO_CLASS_STATE__ERROR;
+
+			break;
+		}
+		case USBH_URB_ERROR:
+		{
+			mlog("USB host failed to write");
+
+			handle->nextState = DX__ETH2USB__ACTIVE_SERVO_CLASS_STATE__ERROR;
 
 			break;
 		}
 		default:
 			break;
 		}
-	} else {
-		printf("Stuff: %02x\r\n", handle->cmd.out[0]);
-
-		usbhStatus = USBH_BulkSendData(phost, handle->cmd.out,
-				64, handle->outPipeNo, 1U);
+	}
 
-		mlog("Writing bulk data");
+	if (handle->nextState != handle->state)
+		return usbhStatus;
 
-		if (usbhStatus != USBH_OK) {
-			mlog("Failed to send bulk data, USB host status: %d", usbhStatus);
+	if (writingState->backingOff) {
+		if ((int32_t) (phost->Timer - writingState->retryTimer) < 0) {
+			DX_USB_ActiveServoClass_WakeAt(phost, writingState->retryTimer);
 
-			usbhStatus = USBH_FAIL;
+			return usbhStatus;
 		}
 
+		writingState->backingOff = false;
+	}
+
+	if (!writingState->written) {
+		if (handle->outSubmittedTimestamp == DX__ETH2USB__TIMESTAMP__NONE)
+			handle->outSubmittedTimestamp = DX_ETH2USB_Timestamp_Now();
+
+		usbhStatus = DX_USB_ActiveServoClass_WritingState_Send(phost, &handle->cmd,
+				writingState->offset);
+
 		writingState->written = true;
 	}
 
@@ -5,59 +5,175 @@
  *      Author: luke
  */
 
+#include <stddef.h>
 #include <string.h>
+#include <lwip/tcp.h>
+#include <lwip/tcpip.h>
 #include <usbh_core.h>
+#include <FreeRTOS.h>
+#include <freertos_mpool.h>
 
 #include "dx/eth2usb/active_servo_class.h"
 #include "dx/eth2usb/app.h"
+#include "dx/eth2usb/timestamp.h"
 #include "logging.h"
 #include "settings.h"
 #include "main.h"
 
-// TODO: Figure out why read() can return -1 with errno 0. For now this weird behavior
-//  won't cause trouble, since my code will ignore errno 0 (dirty hack!).
-
-extern USBH_HandleTypeDef hUsbHostHS;
-extern bool DX_USBH_IsDeviceConnected;
+// A client that doesn't acknowledge anything holds its slots forever, the USB thread waits
+//  for a response slot, so the others must always get one eventually.
+static_assert(DX_ETH2USB__APP__MAX_SESSION_CNT * DX_ETH2USB__APP__MAX_SESSION_RESPONSE_CNT
+		+ DX_ETH2USB__APP__TELEMETRY_RESPONSE_RESERVE < DX_ETH2USB__APP__RESPONSE_MEM_POOL_SIZE,
+		"Sessions can take all response slots");
+// A session never queues more responses than it has slots, the count would never be reached.
+static_assert(DX_ETH2USB__APP__FLUSH_COALESCE_CNT <= DX_ETH2USB__APP__MAX_SESSION_RESPONSE_CNT,
+		"Coalescing waits for more responses than a session can hold");
+
+extern USBH_HandleTypeDef *DX_USBH_Hosts[DX_ETH2USB__USB__MAX_DEVICE_CNT];
+extern bool DX_USBH_IsDeviceConnected[DX_ETH2USB__USB__MAX_DEVICE_CNT];
+extern volatile uint32_t DX_USBH_ConnectionNo[DX_ETH2USB__USB__MAX_DEVICE_CNT];
+extern volatile uint32_t DX_USBH_PlugTick[DX_ETH2USB__USB__MAX_DEVICE_CNT];
+extern volatile uint32_t DX_USBH_ReadyTick[DX_ETH2USB__USB__MAX_DEVICE_CNT];
+
+/// The netconn callback has no user argument, so it reaches the app through this.
+static DX_ETH2USB_AppState_t *DX_ETH2USB_App_Instance = NULL;
+
+/// The control blocks, message buffers and stacks of the RTOS objects of the app, so that
+///  none of them comes from the heap.
+typedef struct {
+	StaticMemPool_t commandMemPoolCb;
+	StaticMemPool_t responseMemPoolCb;
+	StaticQueue_t completionMsgQueueCb;
+	uint8_t completionMsgQueueMem[DX_ETH2USB__APP__COMMAND_MEM_POOL_SIZE
+			* sizeof(DX_ETH2USB_App_Command_t*)];
+	StaticQueue_t telemetryMsgQueueCb;
+	uint8_t telemetryMsgQueueMem[DX_ETH2USB__APP__TELEMETRY_MSG_QUEUE_SIZE
+			* sizeof(DX_ETH2USB_App_Telemetry_t)];
+	StaticQueue_t pollCompletionMsgQueueCb;
+	uint8_t pollCompletionMsgQueueMem[DX_ETH2USB__APP__POLL_ENTRY_CNT
+			* sizeof(DX_ETH2USB_App_PollCompletion_t)];
+	StaticTask_t ethThreadCb;
+	uint64_t ethThreadStack[DX_ETH2USB__APP__ETH_THREAD_STACK_SIZE / sizeof(uint64_t)];
+	StaticTask_t usbThreadCb;
+	uint64_t usbThreadStack[DX_ETH2USB__APP__USB_THREAD_STACK_SIZE / sizeof(uint64_t)];
+	StaticTask_t statusThreadCb;
+	uint64_t statusThreadStack[DX_ETH2USB__APP__STATUS_THREAD_STACK_SIZE / sizeof(uint64_t)];
+} DX_ETH2USB_App_Objects_t;
+
+static DX_ETH2USB_App_Objects_t DX_ETH2USB_App_Objects
+		__attribute__((section(".DtcmSection"), aligned(8)));
+
+/// The blocks of the pools stay out of the DTCM, the OTG and the Ethernet DMA move the
+///  commands and responses straight from and into them.
+static uint8_t DX_ETH2USB_App_CommandMemPoolMem[MEMPOOL_ARR_SIZE(
+		DX_ETH2USB__APP__COMMAND_MEM_POOL_SIZE, sizeof(DX_ETH2USB_App_Command_t))]
+		__attribute__((aligned(32)));
+static uint8_t DX_ETH2USB_App_ResponseMemPoolMem[MEMPOOL_ARR_SIZE(
+		DX_ETH2USB__APP__RESPONSE_MEM_POOL_SIZE, sizeof(DX_ETH2USB_App_Response_t))]
+		__attribute__((aligned(32)));
 
 void DX_ETH2USB_App_Init_CreateMemPools(DX_ETH2USB_AppState_t *app) {
+	DX_ETH2USB_App_Objects_t *objects = &DX_ETH2USB_App_Objects;
+	osMemoryPoolAttr_t attr;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.cb_mem = &objects->commandMemPoolCb;
+	attr.cb_size = sizeof(objects->commandMemPoolCb);
+	attr.mp_mem = DX_ETH2USB_App_CommandMemPoolMem;
+	attr.mp_size = sizeof(DX_ETH2USB_App_CommandMemPoolMem);
+
 	app->commandMemPoolId = osMemoryPoolNew(
-	DX_ETH2USB__APP__COMMAND_MEM_POOL_SIZE, sizeof(DX_ETH2USB_Command_t), NULL);
+	DX_ETH2USB__APP__COMMAND_MEM_POOL_SIZE, sizeof(DX_ETH2USB_App_Command_t), &attr);
 	if (app->commandMemPoolId == NULL)
 		Error_Handler();
 
+	memset(&attr, 0, sizeof(attr));
+	attr.cb_mem = &objects->responseMemPoolCb;
+	attr.cb_size = sizeof(objects->responseMemPoolCb);
+	attr.mp_mem = DX_ETH2USB_App_ResponseMemPoolMem;
+	attr.mp_size = sizeof(DX_ETH2USB_App_ResponseMemPoolMem);
+
 	app->responseMemPoolId = osMemoryPoolNew(
-	DX_ETH2USB__APP__RESPONSE_MEM_POOL_SIZE, sizeof(DX_ETH2USB_Response_t),
-	NULL);
+	DX_ETH2USB__APP__RESPONSE_MEM_POOL_SIZE, sizeof(DX_ETH2USB_App_Response_t),
+	&attr);
 	if (app->responseMemPoolId == NULL)
 		Error_Handler();
 }
 
+void DX_ETH2USB_App_Init_CreateRings(DX_ETH2USB_AppState_t *app) {
+	DX_ETH2USB_Ring_Init(&app->commandRing, app->commandRingSlots,
+			DX__ETH2USB__RING__SLOT_CNT(DX_ETH2USB__APP__COMMAND_MEM_POOL_SIZE));
+	DX_ETH2USB_Ring_Init(&app->responseRing, app->responseRingSlots,
+			DX__ETH2USB__RING__SLOT_CNT(DX_ETH2USB__APP__RESPONSE_MEM_POOL_SIZE));
+}
+
+/// Gets the attributes of a message queue that lives in the given static memory.
+static osMessageQueueAttr_t DX_ETH2USB_App_Init_MsgQueueAttr(StaticQueue_t *cb, void *mem,
+		uint32_t size) {
+	osMessageQueueAttr_t attr;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.cb_mem = cb;
+	attr.cb_size = sizeof(StaticQueue_t);
+	attr.mq_mem = mem;
+	attr.mq_size = size;
+
+	return attr;
+}
+
 void DX_ETH2USB_App_Init_CreateMsgQueues(DX_ETH2USB_AppState_t *app) {
-	app->commandMsgQueueId = osMessageQueueNew(
-	DX_ETH2USB__APP__COMMAND_MSG_QUEUE_SIZE, sizeof(DX_ETH2USB_Command_t*),
-	NULL);
-	if (app->commandMsgQueueId == NULL)
+	DX_ETH2USB_App_Objects_t *objects = &DX_ETH2USB_App_Objects;
+	osMessageQueueAttr_t attr;
+
+	attr = DX_ETH2USB_App_Init_MsgQueueAttr(&objects->completionMsgQueueCb,
+			objects->completionMsgQueueMem, sizeof(objects->completionMsgQueueMem));
+	app->completionMsgQueueId = osMessageQueueNew(
+	DX_ETH2USB__APP__COMMAND_MEM_POOL_SIZE, sizeof(DX_ETH2USB_App_Command_t*),
+	&attr);
+	if (app->completionMsgQueueId == NULL)
+		Error_Handler();
+
+	// Reports are small, so they get copied instead of taking slots of a pool.
+	attr = DX_ETH2USB_App_Init_MsgQueueAttr(&objects->telemetryMsgQueueCb,
+			objects->telemetryMsgQueueMem, sizeof(objects->telemetryMsgQueueMem));
+	app->telemetryMsgQueueId = osMessageQueueNew(
+	DX_ETH2USB__APP__TELEMETRY_MSG_QUEUE_SIZE, sizeof(DX_ETH2USB_App_Telemetry_t),
+	&attr);
+	if (app->telemetryMsgQueueId == NULL)
 		Error_Handler();
 
-	app->responseMsgQueueId = osMessageQueueNew(
-	DX_ETH2USB__APP__RESPONSE_MSG_QUEUE_SIZE, sizeof(DX_ETH2USB_Response_t*),
-	NULL);
-	if (app->responseMsgQueueId == NULL)
+	// Every entry has a single poll in flight at most.
+	attr = DX_ETH2USB_App_Init_MsgQueueAttr(&objects->pollCompletionMsgQueueCb,
+			objects->pollCompletionMsgQueueMem, sizeof(objects->pollCompletionMsgQueueMem));
+	app->pollCompletionMsgQueueId = osMessageQueueNew(
+	DX_ETH2USB__APP__POLL_ENTRY_CNT, sizeof(DX_ETH2USB_App_PollCompletion_t),
+	&attr);
+	if (app->pollCompletionMsgQueueId == NULL)
 		Error_Handler();
 }
 
 static void DX_ETH2USB_App_Init_ThreadAttrs(DX_ETH2USB_AppState_t *app) {
+	DX_ETH2USB_App_Objects_t *objects = &DX_ETH2USB_App_Objects;
+
 	app->ethThreadAttr.name = "DX_ETH2USB_App_EthThread";
-	app->ethThreadAttr.stack_size = 1024;
+	app->ethThreadAttr.cb_mem = &objects->ethThreadCb;
+	app->ethThreadAttr.cb_size = sizeof(objects->ethThreadCb);
+	app->ethThreadAttr.stack_mem = objects->ethThreadStack;
+	app->ethThreadAttr.stack_size = sizeof(objects->ethThreadStack);
 	app->ethThreadAttr.priority = osPriorityNormal;
 
-	app->ethThreadAttr.name = "DX_ETH2USB_App_UsbThread";
-	app->ethThreadAttr.stack_size = 2048;
-	app->ethThreadAttr.priority = osPriorityNormal;
+	app->usbThreadAttr.name = "DX_ETH2USB_App_UsbThread";
+	app->usbThreadAttr.cb_mem = &objects->usbThreadCb;
+	app->usbThreadAttr.cb_size = sizeof(objects->usbThreadCb);
+	app->usbThreadAttr.stack_mem = objects->usbThreadStack;
+	app->usbThreadAttr.stack_size = sizeof(objects->usbThreadStack);
+	app->usbThreadAttr.priority = osPriorityNormal;
 
 	app->statusThreadAttr.name = "DX_ETH2USB_App_StatusThread";
-	app->statusThreadAttr.stack_size = 256;
+	app->statusThreadAttr.cb_mem = &objects->statusThreadCb;
+	app->statusThreadAttr.cb_size = sizeof(objects->statusThreadCb);
+	app->statusThreadAttr.stack_mem = objects->statusThreadStack;
+	app->statusThreadAttr.stack_size = sizeof(objects->statusThreadStack);
 	app->statusThreadAttr.priority = osPriorityNormal;
 }
 
@@ -72,23 +188,58 @@ static void DX_ETH2USB_App_Init_ThreadStates_EthThread_Server(
 	DX_ETH2USB_App_EthThreadState_t *ethThreadState = &app->ethThreadState;
 	DX_ETH2USB_App_EthThread_ServerState_t *server = &ethThreadState->server;
 
-	server->fd = -1;
+	server->conn = NULL;
+	server->port = 8000;
+	server->version = DX__ETH2USB__PROTOCOL_VERSION__1;
+}
+
+static void DX_ETH2USB_App_Init_ThreadStates_EthThread_HelloServer(
+		DX_ETH2USB_AppState_t *app) {
+	DX_ETH2USB_App_EthThreadState_t *ethThreadState = &app->ethThreadState;
+	DX_ETH2USB_App_EthThread_ServerState_t *server = &ethThreadState->helloServer;
 
-	memset(&server->addr, 0, sizeof(struct sockaddr_in));
-	server->addr.sin_family = AF_INET;
-	server->addr.sin_port = htons(8000);
-	server->addr.sin_addr.s_addr = inet_addr("0.0.0.0");
+	server->conn = NULL;
+	server->port = 8001;
+	server->version = 0U;
 }
 
-static void DX_ETH2USB_App_Init_ThreadStates_EthThread_Client(
+static void DX_ETH2USB_App_Init_ThreadStates_EthThread_Udp(
 		DX_ETH2USB_AppState_t *app) {
 	DX_ETH2USB_App_EthThreadState_t *ethThreadState = &app->ethThreadState;
-	DX_ETH2USB_App_EthThread_ClientState_t *client = &ethThreadState->client;
+	DX_ETH2USB_App_EthThread_UdpState_t *udp = &ethThreadState->udp;
+
+	udp->conn = NULL;
+	udp->port = 8000;
+
+	memset(udp->peers, 0, sizeof(udp->peers));
+	memset(&udp->counters, 0, sizeof(udp->counters));
+}
+
+static void DX_ETH2USB_App_Init_ThreadStates_EthThread_Session(
+		DX_ETH2USB_App_EthThread_SessionState_t *session) {
+	session->conn = NULL;
+	session->closing = false;
+	session->pbuf = NULL;
+	session->pbufOffset = 0U;
+
+	session->version = 0U;
+	session->helloPending = false;
+
+	session->command = NULL;
 
-	client->fd = -1;
-	client->connected = false;
+	session->responseQueue.head = 0U;
+	session->responseQueue.count = 0U;
+	session->responseQueue.firstTimestamp = 0U;
 
-	memset(&client->addr, 0, sizeof(struct sockaddr_in));
+	session->unackedQueue.head = 0U;
+	session->unackedQueue.count = 0U;
+
+	session->nResponseSlots = 0U;
+
+	session->nBytesRead = 0U;
+	session->nBytesWritten = 0U;
+
+	session->telemetryMask = 0U;
 }
 
 static void DX_ETH2USB_App_Init_ThreadStates_EthThread(
@@ -96,10 +247,20 @@ static void DX_ETH2USB_App_Init_ThreadStates_EthThread(
 	DX_ETH2USB_App_EthThreadState_t *ethThreadState = &app->ethThreadState;
 
 	DX_ETH2USB_App_Init_ThreadStates_EthThread_Server(app);
-	DX_ETH2USB_App_Init_ThreadStates_EthThread_Client(app);
+	DX_ETH2USB_App_Init_ThreadStates_EthThread_HelloServer(app);
+	DX_ETH2USB_App_Init_ThreadStates_EthThread_Udp(app);
+
+	// The epoch survives the session being reused, so it's only reset here.
+	for (uint8_t i = 0U; i < DX_ETH2USB__APP__MAX_SESSION_CNT; ++i) {
+		ethThreadState->sessions[i].epoch = 0U;
+		DX_ETH2USB_App_Init_ThreadStates_EthThread_Session(
+				&ethThreadState->sessions[i]);
+	}
 
-	ethThreadState->command = NULL;
-	ethThreadState->response = NULL;
+	ethThreadState->nConnectedSessions = 0U;
+
+	memset(&ethThreadState->telemetryCounters, 0,
+			sizeof(ethThreadState->telemetryCounters));
 }
 
 static void DX_ETH2USB_App_Init_ThreadStates_StatusThread(
@@ -114,369 +275,2321 @@ static void DX_ETH2USB_App_Init_ThreadStates_StatusThread(
 	statusThreadState->wasUsbConnected = false;
 }
 
+static void DX_ETH2USB_App_Init_ThreadStates_UsbThread(
+		DX_ETH2USB_AppState_t *app) {
+	DX_ETH2USB_App_UsbThreadState_t *usbThreadState = &app->usbThreadState;
+
+	for (uint8_t deviceNo = 0U; deviceNo < DX_ETH2USB__USB__MAX_DEVICE_CNT; ++deviceNo) {
+		usbThreadState->devices[deviceNo].head = 0U;
+		usbThreadState->devices[deviceNo].count = 0U;
+		usbThreadState->devices[deviceNo].nSubmitted = 0U;
+		usbThreadState->devices[deviceNo].cacheGeneration = 0U;
+		usbThreadState->devices[deviceNo].connectionNo = 0U;
+		usbThreadState->devices[deviceNo].servedConnectionNo = 0U;
+		usbThreadState->devices[deviceNo].plugToFirstCommandMs = 0U;
+	}
+
+	memset(&usbThreadState->cache, 0, sizeof(usbThreadState->cache));
+
+	memset(usbThreadState->pollEntries, 0, sizeof(usbThreadState->pollEntries));
+	for (uint8_t entryNo = 0U; entryNo < DX_ETH2USB__APP__POLL_ENTRY_CNT; ++entryNo)
+		usbThreadState->pollEntries[entryNo].status = DX__ETH2USB__RESPONSE_STATUS__ERR;
+}
+
 static void DX_ETH2USB_App_Init_ThreadStates(DX_ETH2USB_AppState_t *app) {
 	DX_ETH2USB_App_Init_ThreadStates_EthThread(app);
+	DX_ETH2USB_App_Init_ThreadStates_UsbThread(app);
 	DX_ETH2USB_App_Init_ThreadStates_StatusThread(app);
 }
 
+/// Gets called from the USB host thread for every telemetry report of a servo, the arg
+///  is the number of the device.
+static void DX_ETH2USB_App_HandleTelemetry(void *arg, const uint8_t *report,
+		uint16_t length) {
+	DX_ETH2USB_AppState_t *app = DX_ETH2USB_App_Instance;
+	DX_ETH2USB_App_EthThread_TelemetryCounters_t *counters =
+			&app->ethThreadState.telemetryCounters;
+	DX_ETH2USB_App_Telemetry_t telemetry;
+
+	telemetry.deviceNo = (uint8_t) (uintptr_t) arg;
+	telemetry.length = length;
+	memcpy(telemetry.payload, report, length);
+
+	++counters->nReceived;
+
+	// The next report supersedes this one anyway, so the USB host never waits.
+	if (osMessageQueuePut(app->telemetryMsgQueueId, &telemetry, 0U, 0U) != osOK) {
+		++counters->nDroppedQueueFull;
+		return;
+	}
+
+	if (app->ethThreadId != NULL)
+		osThreadFlagsSet(app->ethThreadId,
+				DX_ETH2USB__APP__ETH_THREAD_FLAG__TELEMETRY);
+}
+
+/// Gets called from the USB host thread once a device can take commands, so that the
+///  commands waiting for it get started right away.
+static void DX_ETH2USB_App_HandleDeviceReady(void *arg) {
+	DX_ETH2USB_AppState_t *app = DX_ETH2USB_App_Instance;
+
+	if (app->usbThreadId != NULL)
+		osThreadFlagsSet(app->usbThreadId, DX_ETH2USB__APP__USB_THREAD_FLAG__DEVICE);
+}
+
 void DX_ETH2USB_App_Init(DX_ETH2USB_AppState_t *app) {
 	mlog("Initializing app");
 
+	DX_ETH2USB_App_Instance = app;
+
+	DX_ETH2USB_Timestamp_Init();
+
 	DX_ETH2USB_App_Init_CreateMemPools(app);
+	DX_ETH2USB_App_Init_CreateRings(app);
 	DX_ETH2USB_App_Init_CreateMsgQueues(app);
 	DX_ETH2USB_App_Init_ThreadAttrs(app);
 	DX_ETH2USB_App_Init_Threads(app);
 	DX_ETH2USB_App_Init_ThreadStates(app);
+
+	for (uint8_t deviceNo = 0U; deviceNo < DX_ETH2USB__USB__MAX_DEVICE_CNT; ++deviceNo) {
+		DX_ActiveServoClass_SetTelemetryCallback(deviceNo,
+				DX_ETH2USB_App_HandleTelemetry, (void*) (uintptr_t) deviceNo);
+		DX_ActiveServoClass_SetReadyCallback(deviceNo,
+				DX_ETH2USB_App_HandleDeviceReady, (void*) (uintptr_t) deviceNo);
+	}
 }
 
-static void DX_ETH2USB_App_EthThread_InitializeWritingOfResponse(
-		DX_ETH2USB_AppState_t *app) {
-	DX_ETH2USB_App_EthThreadState_t *threadState = &app->ethThreadState;
-	uint32_t responseCount = 0;
+/// Releases the given command.
+static void DX_ETH2USB_App_FreeCommand(DX_ETH2USB_AppState_t *app,
+		DX_ETH2USB_App_Command_t *command) {
 	osStatus_t status = osOK;
 
-	responseCount = osMessageQueueGetCount(app->responseMsgQueueId);
-	if (responseCount == 0)
-		return;
-
-	status = osMessageQueueGet(app->responseMsgQueueId, &threadState->response,
-	NULL, osWaitForever);
-	if (status != osOK)
+	status = osMemoryPoolFree(app->commandMemPoolId, command);
+	if (status != osOK) {
+		mlog("Failed to free command, status: %d", status);
 		Error_Handler();
+	}
+}
 
-	threadState->nBytesWritten = 0U;
+/// Checks if the given origin belongs to a session that has been closed since, the work
+///  for it can be dropped. Called from both threads, the epoch is a single word.
+static bool DX_ETH2USB_App_IsStale(DX_ETH2USB_AppState_t *app,
+		const DX_ETH2USB_App_Origin_t *origin) {
+	if (origin->sessionNo == DX_ETH2USB__APP__UDP_SESSION_NO)
+		return false;
+
+	return app->ethThreadState.sessions[origin->sessionNo].epoch != origin->epoch;
 }
 
-static void DX_ETH2USB_App_EthThread_CloseClientSocket(
-		DX_ETH2USB_AppState_t *app) {
-	DX_ETH2USB_App_EthThreadState_t *threadState = &app->ethThreadState;
-	DX_ETH2USB_App_EthThread_ClientState_t *client = &threadState->client;
-	int32_t ret = -1;
+/// Gets the number of the device the given command is for.
+static uint8_t DX_ETH2USB_App_DeviceNo(const DX_ETH2USB_App_Command_t *command) {
+	return (command->frame.header.flags & DX__ETH2USB__COMMAND_FLAG__DEVICE_MASK)
+			>> DX__ETH2USB__COMMAND_FLAG__DEVICE_SHIFT;
+}
+
+/// Hands the given command over to the USB thread, which only gets woken if it might
+///  have run out of commands.
+static void DX_ETH2USB_App_EthThread_PushCommand(DX_ETH2USB_AppState_t *app,
+		DX_ETH2USB_App_Command_t *command) {
+	bool wasEmpty = false;
 
-	ret = close(client->fd);
+	DX_ETH2USB_Latency_Stamp(&command->stamps, DX__ETH2USB__LATENCY__STAMP__ENQUEUED);
 
-	if (ret == -1) {
-		mlog("Failed to close client socket, error (%d): %s", errno,
-				strerror(errno));
+	// Cannot overflow, the ring is as large as the command pool.
+	if (!DX_ETH2USB_Ring_Push(&app->commandRing, command, &wasEmpty))
 		Error_Handler();
-	}
 
-	client->fd = -1;
-	client->connected = false;
+	if (wasEmpty)
+		osThreadFlagsSet(app->usbThreadId, DX_ETH2USB__APP__USB_THREAD_FLAG__COMMAND);
 }
 
-static void DX_ETH2USB_App_EthThread_WriteResponse_HandleSuccess(
-		DX_ETH2USB_AppState_t *app, int32_t ret) {
-	DX_ETH2USB_App_EthThreadState_t *threadState = &app->ethThreadState;
-	osStatus status = osOK;
-
-	threadState->nBytesWritten += (uint32_t) ret;
+/// Gets the number of the given session.
+static uint8_t DX_ETH2USB_App_EthThread_SessionNo(DX_ETH2USB_AppState_t *app,
+		DX_ETH2USB_App_EthThread_SessionState_t *session) {
+	return (uint8_t) (session - app->ethThreadState.sessions);
+}
 
-	mlog("Wrote %u out of %u bytes", threadState->nBytesWritten,
-			sizeof(DX_ETH2USB_Response_t));
+/// Releases the given response, and gives its slot back to the session it belongs to
+///  unless that one got closed since.
+static void DX_ETH2USB_App_EthThread_FreeResponse(DX_ETH2USB_AppState_t *app,
+		DX_ETH2USB_App_Response_t *response) {
+	osStatus_t status = osOK;
 
-	if (threadState->nBytesWritten < sizeof(DX_ETH2USB_Response_t))
-		return;
+	if (response->origin.sessionNo != DX_ETH2USB__APP__UDP_SESSION_NO
+			&& !DX_ETH2USB_App_IsStale(app, &response->origin))
+		--app->ethThreadState.sessions[response->origin.sessionNo].nResponseSlots;
 
-	status = osMemoryPoolFree(app->responseMemPoolId, threadState->response);
+	status = osMemoryPoolFree(app->responseMemPoolId, response);
 	if (status != osOK) {
 		mlog("Failed to free response, status: %d", status);
 		Error_Handler();
 	}
+}
+
+/// Finds the peer with the given address, or takes over the least recently seen one
+///  if it's not known yet. Sets isNew if the peer wasn't known.
+static DX_ETH2USB_App_EthThread_UdpPeer_t* DX_ETH2USB_App_EthThread_Udp_FindPeer(
+		DX_ETH2USB_AppState_t *app, const ip_addr_t *addr, uint16_t port,
+		bool *isNew) {
+	DX_ETH2USB_App_EthThread_UdpState_t *udp = &app->ethThreadState.udp;
+	DX_ETH2USB_App_EthThread_UdpPeer_t *oldest = &udp->peers[0];
+	DX_ETH2USB_App_EthThread_UdpPeer_t *peer = NULL;
+
+	for (uint8_t i = 0U; i < DX_ETH2USB__APP__MAX_UDP_PEER_CNT; ++i) {
+		peer = &udp->peers[i];
+
+		if (peer->used && peer->port == port && ip_addr_cmp(&peer->addr, addr)) {
+			*isNew = false;
+			return peer;
+		}
+
+		if (!peer->used
+				|| (oldest->used && peer->lastSeenTick < oldest->lastSeenTick))
+			oldest = peer;
+	}
+
+	ip_addr_copy(oldest->addr, *addr);
+	oldest->port = port;
+	oldest->used = true;
+	oldest->seqNoKnown = false;
+	oldest->telemetryMask = 0U;
+	oldest->telemetrySeqNo = 0U;
 
-	threadState->response = NULL;
+	*isNew = true;
+	return oldest;
 }
 
-static void DX_ETH2USB_App_EthThread_WriteResponse_EndOfStream(
-		DX_ETH2USB_AppState_t *app) {
-	mlog("Received EOS while writing response");
+/// Checks the sequence number of a datagram against the last one of its peer, returns
+///  false if the datagram is stale and must be dropped.
+static bool DX_ETH2USB_App_EthThread_Udp_CheckSeqNo(DX_ETH2USB_AppState_t *app,
+		const ip_addr_t *addr, uint16_t port, uint32_t seqNo) {
+	DX_ETH2USB_App_EthThread_UdpCounters_t *counters =
+			&app->ethThreadState.udp.counters;
+	DX_ETH2USB_App_EthThread_UdpPeer_t *peer = NULL;
+	bool isNew = false;
+	int32_t delta = 0;
+
+	peer = DX_ETH2USB_App_EthThread_Udp_FindPeer(app, addr, port, &isNew);
+	peer->lastSeenTick = osKernelGetTickCount();
+
+	// Peers that only subscribed to telemetry so far don't have a sequence number yet.
+	if (!isNew && peer->seqNoKnown) {
+		// Wrap-around safe, anything at or before the last one is stale.
+		delta = (int32_t) (seqNo - peer->lastSeqNo);
+		if (delta <= 0) {
+			++counters->nDroppedStale;
+			return false;
+		}
+
+		counters->nLost += (uint32_t) (delta - 1);
+	}
 
-	DX_ETH2USB_App_EthThread_CloseClientSocket(app);
+	peer->lastSeqNo = seqNo;
+	peer->seqNoKnown = true;
+
+	return true;
 }
 
-static void DX_ETH2USB_App_EthThread_WriteResponse_HandleError(
-		DX_ETH2USB_AppState_t *app) {
-	if (errno == EAGAIN || errno == 0)
+/// Handles a received telemetry subscription, which replaces the previous one of the peer.
+static void DX_ETH2USB_App_EthThread_Udp_HandleSubscription(
+		DX_ETH2USB_AppState_t *app, struct netbuf *buf) {
+	DX_ETH2USB_App_EthThread_UdpCounters_t *counters =
+			&app->ethThreadState.udp.counters;
+	DX_ETH2USB_TelemetrySubscriptionDatagram_t subscription;
+	DX_ETH2USB_App_EthThread_UdpPeer_t *peer = NULL;
+	bool isNew = false;
+
+	netbuf_copy(buf, &subscription, sizeof(subscription));
+	if (subscription.magic != DX__ETH2USB__TELEMETRY__SUBSCRIPTION_MAGIC) {
+		++counters->nDroppedMalformed;
 		return;
-	else if (errno == ECONNRESET) {
-		mlog("Connection got closed while writing response");
-		DX_ETH2USB_App_EthThread_CloseClientSocket(app);
-	} else {
-		mlog("Failed to write response, error (%d): %s", errno, strerror(errno));
-		Error_Handler();
 	}
+
+	peer = DX_ETH2USB_App_EthThread_Udp_FindPeer(app, netbuf_fromaddr(buf),
+			netbuf_fromport(buf), &isNew);
+	peer->lastSeenTick = osKernelGetTickCount();
+	peer->telemetryMask = subscription.deviceMask;
 }
 
-static void DX_ETH2USB_App_EthThread_WriteResponse(
-		DX_ETH2USB_AppState_t *app) {
-	DX_ETH2USB_App_EthThreadState_t *threadState = &app->ethThreadState;
-	DX_ETH2USB_App_EthThread_ClientState_t *client = &threadState->client;
-	int32_t ret = -1;
+/// Handles a single received datagram, which must contain either exactly one command or
+///  a telemetry subscription.
+static void DX_ETH2USB_App_EthThread_Udp_HandleDatagram(
+		DX_ETH2USB_AppState_t *app, struct netbuf *buf) {
+	DX_ETH2USB_App_EthThread_UdpCounters_t *counters =
+			&app->ethThreadState.udp.counters;
+	DX_ETH2USB_App_Command_t *command = NULL;
+	const ip_addr_t *addr = netbuf_fromaddr(buf);
+	const uint16_t port = netbuf_fromport(buf);
+	const uint32_t receivedTimestamp = DX_ETH2USB_Timestamp_Now();
+	uint32_t seqNo = 0U;
+
+	if (netbuf_len(buf) == sizeof(DX_ETH2USB_TelemetrySubscriptionDatagram_t)) {
+		DX_ETH2USB_App_EthThread_Udp_HandleSubscription(app, buf);
+		return;
+	}
+
+	if (netbuf_len(buf) != sizeof(DX_ETH2USB_CommandDatagram_t)) {
+		++counters->nDroppedMalformed;
+		return;
+	}
 
-	const uint8_t *bytes =
-			&((uint8_t*) threadState->response)[threadState->nBytesWritten];
-	const uint32_t bytesToWrite = sizeof(DX_ETH2USB_Response_t)
-			- threadState->nBytesWritten;
+	netbuf_copy(buf, &seqNo, sizeof(seqNo));
+	seqNo = lwip_ntohl(seqNo);
 
-	ret = write(client->fd, bytes, bytesToWrite);
+	if (!DX_ETH2USB_App_EthThread_Udp_CheckSeqNo(app, addr, port, seqNo))
+		return;
 
-	if (ret > 0) {
-		DX_ETH2USB_App_EthThread_WriteResponse_HandleSuccess(app, ret);
-	} else if (ret == 0) {
-		DX_ETH2USB_App_EthThread_WriteResponse_EndOfStream(app);
-	} else if (ret == -1) {
-		DX_ETH2USB_App_EthThread_WriteResponse_HandleError(app);
+	// A late command is worse than a dropped one, so we never wait for a slot.
+	command = osMemoryPoolAlloc(app->commandMemPoolId, 0U);
+	if (command == NULL) {
+		++counters->nDroppedNoSlot;
+		return;
 	}
+
+	// Datagrams carry version 1 commands, the sequence number does the correlation.
+	memset(&command->frame.header, 0, sizeof(DX_ETH2USB_CommandHeaderV2_t));
+	netbuf_copy_partial(buf, &command->frame.header.flags,
+			sizeof(DX_ETH2USB_CommandHeader_t),
+			offsetof(DX_ETH2USB_CommandDatagram_t, command.header));
+	command->frame.header.flags &= DX__ETH2USB__COMMAND_FLAG__WR_ONLY;
+	netbuf_copy_partial(buf, command->frame.payload,
+			sizeof(command->frame.payload),
+			offsetof(DX_ETH2USB_CommandDatagram_t, command.payload));
+
+	command->length = DX__ETH2USB__COMMAND__PAYLOAD_BUFFER_SIZE;
+	command->maxResponseLength = DX__ETH2USB__RESPONSE__PAYLOAD_BUFFER_SIZE;
+	command->payload = command->frame.payload;
+
+	command->origin.sessionNo = DX_ETH2USB__APP__UDP_SESSION_NO;
+	command->origin.epoch = 0U;
+	command->origin.seqNo = seqNo;
+	ip_addr_copy(command->origin.addr, *addr);
+	command->origin.port = port;
+
+	DX_ETH2USB_Latency_ClearStamps(&command->stamps);
+	command->stamps.at[DX__ETH2USB__LATENCY__STAMP__RECEIVED] = receivedTimestamp;
+
+	DX_ETH2USB_App_EthThread_PushCommand(app, command);
 }
 
-static void DX_ETH2USB_App_EthThread_ReadCommand_HandleSuccess_ForwardToUSB(
+/// Receives a single datagram, returns true if one has been received.
+static bool DX_ETH2USB_App_EthThread_Udp_ReceiveCommand(
 		DX_ETH2USB_AppState_t *app) {
-	DX_ETH2USB_App_EthThreadState_t *threadState = &app->ethThreadState;
-	osStatus_t status = osOK;
-
-	status = osMessageQueuePut(app->commandMsgQueueId, &threadState->command,
-			0U, osWaitForever);
-	if (status != osOK) {
-		Error_Handler();
+	DX_ETH2USB_App_EthThread_UdpState_t *udp = &app->ethThreadState.udp;
+	struct netbuf *buf = NULL;
+	err_t err = ERR_OK;
+
+	err = netconn_recv(udp->conn, &buf);
+	if (err == ERR_WOULDBLOCK)
+		return false;
+	else if (err != ERR_OK) {
+		mlog("Failed to receive datagram, error: %d", err);
+		return false;
 	}
 
-	threadState->command = NULL;
+	++udp->counters.nReceived;
+
+	DX_ETH2USB_App_EthThread_Udp_HandleDatagram(app, buf);
+
+	netbuf_delete(buf);
+
+	return true;
 }
 
-static void DX_ETH2USB_App_EthThread_ReadCommand_HandleSuccess(
-		DX_ETH2USB_AppState_t *app, int32_t ret) {
-	DX_ETH2USB_App_EthThreadState_t *threadState = &app->ethThreadState;
+/// Takes the time the given response got handed over to lwIP entirely, and records the
+///  stages that end there.
+static void DX_ETH2USB_App_EthThread_RecordWritten(DX_ETH2USB_AppState_t *app,
+		DX_ETH2USB_App_Response_t *response) {
+	DX_ETH2USB_Latency_Stamp(&response->stamps,
+			DX__ETH2USB__LATENCY__STAMP__RESPONSE_WRITTEN);
+
+	DX_ETH2USB_Latency_Record(&app->latency, &response->stamps,
+			DX__ETH2USB__LATENCY__STAMP__RESPONSE_WRITTEN);
+	DX_ETH2USB_Latency_Record(&app->latency, &response->stamps,
+			DX__ETH2USB__LATENCY__STAGE__ROUND_TRIP);
+}
 
-	threadState->nBytesRead += (uint32_t) ret;
+/// Clears the fixed size payload of the given response past what the servo sent, the IN
+///  buffer isn't cleared so it still holds whatever an earlier command left in the block.
+static void DX_ETH2USB_App_EthThread_PadFixedPayload(
+		DX_ETH2USB_App_Response_t *response) {
+	uint16_t length = lwip_ntohs(response->frame.header.length);
+
+	if (length < DX__ETH2USB__RESPONSE__PAYLOAD_BUFFER_SIZE)
+		memset(&response->frame.payload[length], 0,
+				DX__ETH2USB__RESPONSE__PAYLOAD_BUFFER_SIZE - length);
+}
 
-	mlog("Read %u bytes out of the %u bytes", ret,
-			sizeof(DX_ETH2USB_Command_t));
+/// Sends the given response back to the peer the command came from.
+static void DX_ETH2USB_App_EthThread_Udp_SendResponse(
+		DX_ETH2USB_AppState_t *app, DX_ETH2USB_App_Response_t *response) {
+	DX_ETH2USB_App_EthThread_UdpState_t *udp = &app->ethThreadState.udp;
+	DX_ETH2USB_ResponseDatagram_t *datagram = NULL;
+	struct netbuf *buf = NULL;
+	err_t err = ERR_OK;
+
+	buf = netbuf_new();
+	if (buf == NULL) {
+		++udp->counters.nDroppedResponses;
+		return;
+	}
 
-	if (threadState->nBytesRead < sizeof(DX_ETH2USB_Command_t))
+	datagram = netbuf_alloc(buf, sizeof(DX_ETH2USB_ResponseDatagram_t));
+	if (datagram == NULL) {
+		++udp->counters.nDroppedResponses;
+		netbuf_delete(buf);
 		return;
+	}
+
+	datagram->seqNo = lwip_htonl(response->origin.seqNo);
+	DX_ETH2USB_App_EthThread_PadFixedPayload(response);
+	memcpy(datagram->response.payload, response->frame.payload,
+			DX__ETH2USB__RESPONSE__PAYLOAD_BUFFER_SIZE);
 
-	mlog("Received entire command of size %u", threadState->nBytesRead);
+	err = netconn_sendto(udp->conn, buf, &response->origin.addr,
+			response->origin.port);
+	if (err != ERR_OK) {
+		mlog("Failed to send response datagram, error: %d", err);
+		++udp->counters.nDroppedResponses;
+	} else {
+		++udp->counters.nSent;
+
+		DX_ETH2USB_App_EthThread_RecordWritten(app, response);
+	}
 
-	DX_ETH2USB_App_EthThread_ReadCommand_HandleSuccess_ForwardToUSB(
-			app);
+	netbuf_delete(buf);
 }
 
-static void DX_ETH2USB_App_EthThread_ReadCommand_HandleEndOfStream(
-		DX_ETH2USB_AppState_t *app) {
-	mlog("Received end of stream while reading incoming command");
+/// Appends the given response to the queue of the session.
+static void DX_ETH2USB_App_EthThread_EnqueueResponse(
+		DX_ETH2USB_App_EthThread_SessionState_t *session,
+		DX_ETH2USB_App_Response_t *response) {
+	DX_ETH2USB_App_EthThread_ResponseQueue_t *queue = &session->responseQueue;
 
-	DX_ETH2USB_App_EthThread_CloseClientSocket(app);
+	// The coalescing timeout starts with the first response that has to wait.
+	if (queue->count == 0U)
+		queue->firstTimestamp = DX_ETH2USB_Timestamp_Now();
+
+	// Cannot overflow, the queue is as large as the response pool.
+	queue->responses[(queue->head + queue->count)
+			% DX_ETH2USB__APP__RESPONSE_MEM_POOL_SIZE] = response;
+	++queue->count;
 }
 
-static void DX_ETH2USB_App_EthThread_ReadCommand_HandleError(
+/// Moves the responses produced by the USB thread into the queues of the sessions
+///  they belong to, returns true if any response has been routed.
+static bool DX_ETH2USB_App_EthThread_RouteResponses(
 		DX_ETH2USB_AppState_t *app) {
+	DX_ETH2USB_App_EthThreadState_t *threadState = &app->ethThreadState;
+	DX_ETH2USB_App_EthThread_SessionState_t *session = NULL;
+	DX_ETH2USB_App_Response_t *response = NULL;
+	void *item = NULL;
+	bool progress = false;
+
+	while (DX_ETH2USB_Ring_Pop(&app->responseRing, &item)) {
+		response = item;
+		progress = true;
+
+		// Responses to datagrams don't have to wait for anything.
+		if (response->origin.sessionNo == DX_ETH2USB__APP__UDP_SESSION_NO) {
+			DX_ETH2USB_App_EthThread_Udp_SendResponse(app, response);
+			DX_ETH2USB_App_EthThread_FreeResponse(app, response);
+			continue;
+		}
 
-	if (errno == EAGAIN || errno == 0)
-		return;
-	else if (errno == ECONNRESET) {
-		mlog("Remote closed stream while reading incoming command");
-		DX_ETH2USB_App_EthThread_CloseClientSocket(app);
-	} else {
-		mlog("Failed to read incoming command, error (%d): %s", errno,
-				strerror(errno));
-		Error_Handler();
+		session = &threadState->sessions[response->origin.sessionNo];
+
+		// The session got closed while its command was being executed, and might even
+		//  have been taken over by another client since.
+		if (DX_ETH2USB_App_IsStale(app, &response->origin)) {
+			mlog("Dropping stale response for session %u",
+					response->origin.sessionNo);
+			DX_ETH2USB_App_EthThread_FreeResponse(app, response);
+			continue;
+		}
+
+		DX_ETH2USB_App_EthThread_EnqueueResponse(session, response);
 	}
+
+	return progress;
 }
 
-static void DX_ETH2USB_App_EthThread_StartReadingCommand(
-		DX_ETH2USB_AppState_t *app) {
-	DX_ETH2USB_App_EthThreadState_t *threadState = &app->ethThreadState;
+/// Queues the given telemetry report for the session as a response frame of its own.
+static void DX_ETH2USB_App_EthThread_QueueTelemetry(DX_ETH2USB_AppState_t *app,
+		DX_ETH2USB_App_EthThread_SessionState_t *session,
+		const DX_ETH2USB_App_Telemetry_t *telemetry) {
+	DX_ETH2USB_App_EthThread_TelemetryCounters_t *counters =
+			&app->ethThreadState.telemetryCounters;
+	DX_ETH2USB_App_Response_t *response = NULL;
+
+	// Telemetry is sent as long as there is room, it never takes the last slots.
+	if (osMemoryPoolGetSpace(app->responseMemPoolId)
+			<= DX_ETH2USB__APP__TELEMETRY_RESPONSE_RESERVE
+			|| session->nResponseSlots >= DX_ETH2USB__APP__MAX_SESSION_RESPONSE_CNT) {
+		++counters->nDroppedNoSlot;
+		return;
+	}
 
-	if (osMemoryPoolGetSpace(app->commandMemPoolId) == 0)
+	response = osMemoryPoolAlloc(app->responseMemPoolId, 0U);
+	if (response == NULL) {
+		++counters->nDroppedNoSlot;
 		return;
+	}
 
-	threadState->command = osMemoryPoolAlloc(app->commandMemPoolId, 0U);
-	if (threadState->command == NULL)
-		Error_Handler();
+	response->origin.sessionNo = DX_ETH2USB_App_EthThread_SessionNo(app, session);
+	response->origin.epoch = session->epoch;
+	DX_ETH2USB_Latency_ClearStamps(&response->stamps);
+	++session->nResponseSlots;
 
-	threadState->nBytesRead = 0;
+	memset(&response->frame.header, 0, sizeof(DX_ETH2USB_ResponseHeaderV2_t));
+	response->frame.header.flags = DX__ETH2USB__RESPONSE_FLAG__TELEMETRY
+			| (telemetry->deviceNo << DX__ETH2USB__RESPONSE_FLAG__DEVICE_SHIFT);
+	response->frame.header.status = DX__ETH2USB__RESPONSE_STATUS__OK;
+	response->frame.header.length = lwip_htons(telemetry->length);
+	memcpy(response->frame.payload, telemetry->payload, telemetry->length);
+
+	DX_ETH2USB_App_EthThread_EnqueueResponse(session, response);
 }
 
-static void DX_ETH2USB_App_EthThread_ReadCommand(
-		DX_ETH2USB_AppState_t *app) {
-	DX_ETH2USB_App_EthThreadState_t *threadState = &app->ethThreadState;
-	DX_ETH2USB_App_EthThread_ClientState_t *client = &threadState->client;
-	int32_t ret = -1;
+/// Sends the given telemetry report to every peer that subscribed to it, and whose lease
+///  didn't run out.
+static void DX_ETH2USB_App_EthThread_Udp_SendTelemetry(
+		DX_ETH2USB_AppState_t *app, const DX_ETH2USB_App_Telemetry_t *telemetry) {
+	DX_ETH2USB_App_EthThread_UdpState_t *udp = &app->ethThreadState.udp;
+	DX_ETH2USB_App_EthThread_UdpPeer_t *peer = NULL;
+	DX_ETH2USB_TelemetryDatagram_t *datagram = NULL;
+	struct netbuf *buf = NULL;
+	const uint32_t now = osKernelGetTickCount();
+	err_t err = ERR_OK;
+
+	for (uint8_t i = 0U; i < DX_ETH2USB__APP__MAX_UDP_PEER_CNT; ++i) {
+		peer = &udp->peers[i];
+
+		if (!peer->used || !(peer->telemetryMask & (1U << telemetry->deviceNo))
+				|| now - peer->lastSeenTick >= DX_ETH2USB__APP__TELEMETRY_LEASE_MS)
+			continue;
+
+		buf = netbuf_new();
+		if (buf == NULL) {
+			++udp->counters.nDroppedTelemetry;
+			continue;
+		}
 
-	const uint32_t nBytesToRead = sizeof(DX_ETH2USB_Command_t) - threadState->nBytesRead;
-	uint8_t *bytes = &((uint8_t*) threadState->command)[threadState->nBytesRead];
+		datagram = netbuf_alloc(buf,
+				offsetof(DX_ETH2USB_TelemetryDatagram_t, payload) + telemetry->length);
+		if (datagram == NULL) {
+			++udp->counters.nDroppedTelemetry;
+			netbuf_delete(buf);
+			continue;
+		}
 
-	ret = read(client->fd, bytes, nBytesToRead);
+		datagram->seqNo = lwip_htonl(peer->telemetrySeqNo++);
+		datagram->deviceNo = telemetry->deviceNo;
+		datagram->reserved = 0U;
+		datagram->length = lwip_htons(telemetry->length);
+		memcpy(datagram->payload, telemetry->payload, telemetry->length);
+
+		err = netconn_sendto(udp->conn, buf, &peer->addr, peer->port);
+		if (err != ERR_OK) {
+			mlog("Failed to send telemetry datagram, error: %d", err);
+			++udp->counters.nDroppedTelemetry;
+		} else {
+			++udp->counters.nSent;
+		}
 
-	if (ret > 0) {
-		DX_ETH2USB_App_EthThread_ReadCommand_HandleSuccess(app, ret);
-	} else if (ret == 0) {
-		DX_ETH2USB_App_EthThread_ReadCommand_HandleEndOfStream(app);
-	} else if (ret == -1) {
-		DX_ETH2USB_App_EthThread_ReadCommand_HandleError(app);
+		netbuf_delete(buf);
 	}
 }
 
-/// Starts the server socket for the Ethernet thread.
-static void DX_ETH2USB_App_EthThread_StartServerSocket(
+/// Passes the telemetry reports of the servos on to the sessions and peers that subscribed
+///  to them, returns true if any report has been handled.
+static bool DX_ETH2USB_App_EthThread_PublishTelemetry(
 		DX_ETH2USB_AppState_t *app) {
 	DX_ETH2USB_App_EthThreadState_t *threadState = &app->ethThreadState;
-	DX_ETH2USB_App_EthThread_ServerState_t *server = &threadState->server;
+	DX_ETH2USB_App_EthThread_SessionState_t *session = NULL;
+	DX_ETH2USB_App_Telemetry_t telemetry;
+	bool progress = false;
 
-	int32_t ret = -1;
+	while (osMessageQueueGet(app->telemetryMsgQueueId, &telemetry, NULL, 0U)
+			== osOK) {
+		progress = true;
 
-	server->fd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-	if (server->fd == -1) {
-		mlog("Failed to create server socket, error (%d): %s", errno,
-				strerror(errno));
-		Error_Handler();
-	}
+		for (uint8_t i = 0U; i < DX_ETH2USB__APP__MAX_SESSION_CNT; ++i) {
+			session = &threadState->sessions[i];
 
-	ret = bind(server->fd, (struct sockaddr* )&server->addr,
-			sizeof(struct sockaddr_in));
-	if (ret == -1) {
-		mlog("Failed to bind server socket, error (%d): %s", errno,
-				strerror(errno));
-		Error_Handler();
+			if (session->conn != NULL && !session->closing
+					&& (session->telemetryMask & (1U << telemetry.deviceNo)))
+				DX_ETH2USB_App_EthThread_QueueTelemetry(app, session, &telemetry);
+		}
+
+		DX_ETH2USB_App_EthThread_Udp_SendTelemetry(app, &telemetry);
 	}
 
-	ret = listen(server->fd, 0);
-	if (ret == -1) {
-		mlog("Failed to listen server socket, error (%d): %s", errno,
-				strerror(errno));
-		Error_Handler();
+	return progress;
+}
+
+/// Takes the first response out of the queue of the session, returns NULL if there is
+///  none.
+static DX_ETH2USB_App_Response_t* DX_ETH2USB_App_EthThread_DequeueResponse(
+		DX_ETH2USB_App_EthThread_SessionState_t *session) {
+	DX_ETH2USB_App_EthThread_ResponseQueue_t *queue = &session->responseQueue;
+	DX_ETH2USB_App_Response_t *response = NULL;
+
+	if (queue->count == 0U)
+		return NULL;
+
+	response = queue->responses[queue->head];
+	queue->head = (queue->head + 1U) % DX_ETH2USB__APP__RESPONSE_MEM_POOL_SIZE;
+	--queue->count;
+
+	return response;
+}
+
+/// Keeps the given written response until the client acknowledged it, lwIP references
+///  it instead of holding a copy.
+static void DX_ETH2USB_App_EthThread_HoldResponseUntilAcked(
+		DX_ETH2USB_App_EthThread_SessionState_t *session,
+		DX_ETH2USB_App_Response_t *response, uint32_t endSeqNo) {
+	DX_ETH2USB_App_EthThread_UnackedQueue_t *queue = &session->unackedQueue;
+	DX_ETH2USB_App_EthThread_UnackedResponse_t *entry = NULL;
+
+	// Cannot overflow, the queue is as large as the response pool.
+	entry = &queue->responses[(queue->head + queue->count)
+			% DX_ETH2USB__APP__RESPONSE_MEM_POOL_SIZE];
+	entry->response = response;
+	entry->endSeqNo = endSeqNo;
+	++queue->count;
+}
+
+/// Releases the responses the client acknowledged, returns true if any response has
+///  been released.
+static bool DX_ETH2USB_App_EthThread_ReleaseAckedResponses(
+		DX_ETH2USB_AppState_t *app,
+		DX_ETH2USB_App_EthThread_SessionState_t *session) {
+	DX_ETH2USB_App_EthThread_UnackedQueue_t *queue = &session->unackedQueue;
+	DX_ETH2USB_App_EthThread_UnackedResponse_t *entry = NULL;
+	struct tcp_pcb *pcb = NULL;
+	uint32_t lastAck = 0U;
+	bool progress = false;
+
+	if (queue->count == 0U)
+		return false;
+
+	LOCK_TCPIP_CORE();
+	pcb = session->conn->pcb.tcp;
+	if (pcb != NULL)
+		lastAck = pcb->lastack;
+	UNLOCK_TCPIP_CORE();
+
+	while (queue->count > 0U) {
+		entry = &queue->responses[queue->head];
+
+		// Without a PCB lwIP doesn't reference anything anymore.
+		if (pcb != NULL && (int32_t) (lastAck - entry->endSeqNo) < 0)
+			break;
+
+		DX_ETH2USB_App_EthThread_FreeResponse(app, entry->response);
+
+		queue->head = (queue->head + 1U) % DX_ETH2USB__APP__RESPONSE_MEM_POOL_SIZE;
+		--queue->count;
+
+		progress = true;
 	}
+
+	return progress;
 }
 
-static void DX_ETH2USB_App_EthThread_AcceptClientSocket(
-		DX_ETH2USB_AppState_t *app) {
+/// Checks if the given error means that the remote is gone.
+static bool DX_ETH2USB_App_EthThread_IsConnectionLost(err_t err) {
+	return err == ERR_ABRT || err == ERR_RST || err == ERR_CLSD
+			|| err == ERR_CONN;
+}
+
+static void DX_ETH2USB_App_EthThread_CloseClientSocket(
+		DX_ETH2USB_AppState_t *app,
+		DX_ETH2USB_App_EthThread_SessionState_t *session) {
 	DX_ETH2USB_App_EthThreadState_t *threadState = &app->ethThreadState;
-	DX_ETH2USB_App_EthThread_ServerState_t *server = &threadState->server;
-	DX_ETH2USB_App_EthThread_ClientState_t *client = &threadState->client;
-	int32_t flags = 0;
-	int32_t ret = 0;
-
-	client->fd = accept(server->fd, (struct sockaddr* ) &client->addr,
-			&client->socklen);
-	if (client->fd == -1) {
-		mlog("Failed to accept client socket, error (%d): %s", errno,
-				strerror(errno));
-		Error_Handler();
+	DX_ETH2USB_App_Response_t *response = NULL;
+	err_t err = ERR_OK;
+
+	if (session->pbuf != NULL) {
+		pbuf_free(session->pbuf);
+		session->pbuf = NULL;
 	}
 
-	flags = fcntl(client->fd, F_GETFL, 0);
-	if (ret == -1) {
-		mlog("Failed to get client socket flags, error (%d): %s", errno,
-				strerror(errno));
+	err = netconn_close(session->conn);
+	if (err != ERR_OK && err != ERR_CONN && err != ERR_CLSD)
+		mlog("Failed to close client connection, error: %d", err);
+
+	err = netconn_delete(session->conn);
+	if (err != ERR_OK) {
+		mlog("Failed to delete client connection, error: %d", err);
 		Error_Handler();
 	}
 
-	flags |= O_NONBLOCK;
+	session->conn = NULL;
+	session->telemetryMask = 0U;
+	++session->epoch;
 
-	ret = fcntl(client->fd, F_SETFL, flags);
-	if (ret == -1) {
-		mlog("Failed to set client socket flags, error (%d): %s", errno,
-				strerror(errno));
-		Error_Handler();
+	// Releases the frames that belonged to this session.
+	if (session->command != NULL) {
+		DX_ETH2USB_App_FreeCommand(app, session->command);
+		session->command = NULL;
 	}
 
-	mlog("Accepted client socket %s:%u", inet_ntoa(client->addr),
-			ntohs(client->addr.sin_port));
+	while ((response = DX_ETH2USB_App_EthThread_DequeueResponse(session)) != NULL)
+		DX_ETH2USB_App_EthThread_FreeResponse(app, response);
 
-	threadState->nBytesRead = 0U;
+	// Either acknowledged, or lwIP dropped the connection along with its segments.
+	while (session->unackedQueue.count > 0U) {
+		DX_ETH2USB_App_EthThread_FreeResponse(app,
+				session->unackedQueue.responses[session->unackedQueue.head].response);
+		session->unackedQueue.head = (session->unackedQueue.head + 1U)
+				% DX_ETH2USB__APP__RESPONSE_MEM_POOL_SIZE;
+		--session->unackedQueue.count;
+	}
 
-	client->connected = true;
+	--threadState->nConnectedSessions;
 }
 
-static void DX_ETH2USB_App_EthThread(void *arg) {
-	DX_ETH2USB_AppState_t *app = arg;
-	DX_ETH2USB_App_EthThreadState_t *threadState = &app->ethThreadState;
-	DX_ETH2USB_App_EthThread_ClientState_t *client = &threadState->client;
+/// Stops reading from the given session, it gets closed once the responses to the
+///  commands it sent have been written and acknowledged.
+static void DX_ETH2USB_App_EthThread_ShutdownClientSocket(
+		DX_ETH2USB_App_EthThread_SessionState_t *session) {
+	session->closing = true;
+	session->telemetryMask = 0U;
+}
 
-	DX_ETH2USB_App_EthThread_StartServerSocket(app);
+static void DX_ETH2USB_App_EthThread_WriteFrame_HandleError(
+		DX_ETH2USB_AppState_t *app,
+		DX_ETH2USB_App_EthThread_SessionState_t *session, err_t err) {
+	if (err == ERR_WOULDBLOCK)
+		return;
+	else if (DX_ETH2USB_App_EthThread_IsConnectionLost(err)) {
+		mlog("Connection got closed while writing, error: %d", err);
+		DX_ETH2USB_App_EthThread_CloseClientSocket(app, session);
+	} else {
+		mlog("Failed to write, error: %d", err);
+		Error_Handler();
+	}
+}
 
-	while (true) {
-		while (threadState->client.fd == -1)
-			DX_ETH2USB_App_EthThread_AcceptClientSocket(app);
+/// Writes as much of the given frame as the send buffer allows, continuing at
+///  nBytesWritten. Returns true if any progress has been made.
+static bool DX_ETH2USB_App_EthThread_WriteFrame(DX_ETH2USB_AppState_t *app,
+		DX_ETH2USB_App_EthThread_SessionState_t *session, const void *frame,
+		uint32_t size) {
+	size_t written = 0U;
+	err_t err = ERR_OK;
 
-		if (threadState->response == NULL)
-			DX_ETH2USB_App_EthThread_InitializeWritingOfResponse(app);
+	const uint8_t *bytes = &((const uint8_t*) frame)[session->nBytesWritten];
+	const uint32_t bytesToWrite = size - session->nBytesWritten;
 
-		if (threadState->response != NULL)
-			DX_ETH2USB_App_EthThread_WriteResponse(app);
+	err = netconn_write_partly(session->conn, bytes, bytesToWrite,
+			NETCONN_COPY | NETCONN_DONTBLOCK, &written);
 
-		if (client->fd == -1)
-			continue;
+	if (err == ERR_OK && written > 0U) {
+		session->nBytesWritten += (uint32_t) written;
 
-		if (threadState->command == NULL)
-			DX_ETH2USB_App_EthThread_StartReadingCommand(app);
-		if (threadState->command != NULL)
-			DX_ETH2USB_App_EthThread_ReadCommand(app);
+		mlog("Wrote %u out of %u bytes", session->nBytesWritten, size);
 
-		osDelay(1);
+		return true;
+	} else if (err != ERR_OK) {
+		DX_ETH2USB_App_EthThread_WriteFrame_HandleError(app, session, err);
+		return err != ERR_WOULDBLOCK;
 	}
+
+	return false;
 }
 
-static void DX_ETH2USB_App_UsbThread_GetCommand(DX_ETH2USB_AppState_t *app) {
-	DX_ETH2USB_App_UsbThreadState_t *threadState = &app->usbThreadState;
-	osStatus_t status = osOK;
+/// Writes the answer to the hello of the client.
+static bool DX_ETH2USB_App_EthThread_WriteHello(DX_ETH2USB_AppState_t *app,
+		DX_ETH2USB_App_EthThread_SessionState_t *session) {
+	bool progress = false;
 
-	status = osMessageQueueGet(app->commandMsgQueueId, &threadState->command,
-	NULL, osWaitForever);
-	if (status != osOK)
-		Error_Handler();
+	progress = DX_ETH2USB_App_EthThread_WriteFrame(app, session,
+			&session->hello, sizeof(DX_ETH2USB_Hello_t));
+
+	if (session->conn != NULL
+			&& session->nBytesWritten == sizeof(DX_ETH2USB_Hello_t)) {
+		session->helloPending = false;
+		session->nBytesWritten = 0U;
+	}
+
+	return progress;
 }
 
-static void DX_ETH2USB_App_UsbThread_PutResponse(DX_ETH2USB_AppState_t *app) {
-	DX_ETH2USB_App_UsbThreadState_t *threadState = &app->usbThreadState;
-	osStatus status = osOK;
+/// Gets the number of commands the gateway can take in right now from the session, which
+///  gets advertised to version 2 clients as their credits. The slots of the given number
+///  of responses that have been handed to lwIP count as free, the client will have them
+///  by the time it uses the credits.
+static uint8_t DX_ETH2USB_App_EthThread_Credits(DX_ETH2USB_AppState_t *app,
+		DX_ETH2USB_App_EthThread_SessionState_t *session, uint8_t nDelivered) {
+	uint32_t credits = osMemoryPoolGetSpace(app->commandMemPoolId);
+	uint8_t nHeld = session->nResponseSlots - nDelivered;
 
-	status = osMessageQueuePut(app->responseMsgQueueId, &threadState->response, 0U,
-	osWaitForever);
-	if (status != osOK)
-		Error_Handler();
+	// Never more than StartReadingCommand() takes in, or the client stalls on the window.
+	if (credits > DX_ETH2USB__APP__MAX_SESSION_RESPONSE_CNT - nHeld)
+		credits = DX_ETH2USB__APP__MAX_SESSION_RESPONSE_CNT - nHeld;
+
+	mlog("Session %u gets %lu credits, %u of its %u response slots held",
+			DX_ETH2USB_App_EthThread_SessionNo(app, session), credits, nHeld,
+			DX_ETH2USB__APP__MAX_SESSION_RESPONSE_CNT);
 
-	threadState->response = NULL;
+	return (uint8_t) credits;
 }
 
-static void DX_ETH2USB_App_UsbThread(void *arg) {
-	DX_ETH2USB_AppState_t *app = arg;
-	DX_ETH2USB_App_UsbThreadState_t *threadState = &app->usbThreadState;
-	DX_ActiveServoClass_StatusTypeDef activeServoClassStatus =
-			DX__ACTIVE_SERVO_CLASS__OK;
+/// Gets the bytes of the given response that go on the wire for the version of the
+///  session.
+static uint32_t DX_ETH2USB_App_EthThread_ResponseBytes(
+		DX_ETH2USB_App_EthThread_SessionState_t *session,
+		DX_ETH2USB_App_Response_t *response, const uint8_t **bytes) {
+	DX_ETH2USB_ResponseV2_t *frame = &response->frame;
+
+	// Version 1 clients don't know about the response header, and always get a fixed
+	//  size payload.
+	if (session->version == DX__ETH2USB__PROTOCOL_VERSION__1) {
+		DX_ETH2USB_App_EthThread_PadFixedPayload(response);
+		*bytes = frame->payload;
+		return DX__ETH2USB__RESPONSE__PAYLOAD_BUFFER_SIZE;
+	}
 
-	while (true) {
-		if (!DX_USBH_IsDeviceConnected) {
-			osDelay(50);
-			continue;
+	*bytes = (const uint8_t*) frame;
+	return sizeof(DX_ETH2USB_ResponseHeaderV2_t) + lwip_ntohs(frame->header.length);
+}
+
+/// Checks if the queued responses of the session are to be written now, or rather
+///  coalesced with the ones still to come.
+static bool DX_ETH2USB_App_EthThread_ShouldFlush(
+		DX_ETH2USB_App_EthThread_SessionState_t *session) {
+	DX_ETH2USB_App_EthThread_ResponseQueue_t *queue = &session->responseQueue;
+
+	if (queue->count == 0U)
+		return false;
+
+#if DX_ETH2USB__APP__FLUSH_POLICY == DX_ETH2USB__APP__FLUSH_POLICY__COALESCE
+	// A response that has been partially written already gets finished.
+	if (session->nBytesWritten > 0U
+			|| queue->count >= DX_ETH2USB__APP__FLUSH_COALESCE_CNT)
+		return true;
+
+	return DX_ETH2USB_Timestamp_ToMicros(
+			DX_ETH2USB_Timestamp_Now() - queue->firstTimestamp)
+			>= DX_ETH2USB__APP__FLUSH_COALESCE_TIMEOUT_US;
+#else
+	return true;
+#endif
+}
+
+/// Writes as many of the queued responses as the send buffer allows with a single
+///  vectored write, continuing at nBytesWritten of the first one. Returns true if any
+///  progress has been made.
+static bool DX_ETH2USB_App_EthThread_WriteResponses(
+		DX_ETH2USB_AppState_t *app,
+		DX_ETH2USB_App_EthThread_SessionState_t *session) {
+	DX_ETH2USB_App_EthThread_ResponseQueue_t *queue = &session->responseQueue;
+	struct netvector vectors[DX_ETH2USB__APP__MAX_FLUSH_VECTOR_CNT];
+	DX_ETH2USB_App_Response_t *response = NULL;
+	struct tcp_pcb *pcb = NULL;
+	const uint8_t *bytes = NULL;
+	uint32_t size = 0U;
+	uint32_t endSeqNo = 0U;
+	size_t written = 0U;
+	u16_t nVectors = 0U;
+	err_t err = ERR_OK;
+
+	while (nVectors < queue->count
+			&& nVectors < DX_ETH2USB__APP__MAX_FLUSH_VECTOR_CNT) {
+		response = queue->responses[(queue->head + nVectors)
+				% DX_ETH2USB__APP__RESPONSE_MEM_POOL_SIZE];
+		size = DX_ETH2USB_App_EthThread_ResponseBytes(session, response, &bytes);
+
+		// The credits are refreshed until lwIP got hold of the first byte.
+		if (nVectors > 0U || session->nBytesWritten == 0U) {
+			if (session->version != DX__ETH2USB__PROTOCOL_VERSION__1)
+				response->frame.header.credits =
+						DX_ETH2USB_App_EthThread_Credits(app, session,
+								session->unackedQueue.count + nVectors + 1U);
+		} else {
+			bytes += session->nBytesWritten;
+			size -= session->nBytesWritten;
 		}
 
-		DX_ETH2USB_App_UsbThread_GetCommand(app);
+		// The Ethernet DMA reads the frames straight from the response pool.
+		SCB_CleanDCache_by_Addr((uint32_t*) bytes, (int32_t) size);
+
+		vectors[nVectors].ptr = bytes;
+		vectors[nVectors].len = size;
+		++nVectors;
+	}
+
+	err = netconn_write_vectors_partly(session->conn, vectors, nVectors,
+			NETCONN_NOCOPY | NETCONN_DONTBLOCK, &written);
+	if (err != ERR_OK) {
+		DX_ETH2USB_App_EthThread_WriteFrame_HandleError(app, session, err);
+		return err != ERR_WOULDBLOCK;
+	}
 
-		uint8_t *in = NULL;
+	if (written == 0U)
+		return false;
 
-		if (!threadState->command->header.wrOnly) {
-			threadState->response = osMemoryPoolAlloc(app->responseMemPoolId, 0U);
-			if (threadState->response == NULL)
-				Error_Handler();
+	mlog("Wrote %u bytes of %u responses", (uint32_t) written, nVectors);
 
-			in = threadState->response->payload;
-		}
+	LOCK_TCPIP_CORE();
+	pcb = session->conn->pcb.tcp;
+	if (pcb != NULL)
+		endSeqNo = pcb->snd_lbb - (uint32_t) written;
+	UNLOCK_TCPIP_CORE();
 
-		activeServoClassStatus = DX_ActiveServoClass_Cmd(&hUsbHostHS,
-				threadState->command->payload, in);
-		if (activeServoClassStatus != DX__ACTIVE_SERVO_CLASS__OK) {
-			mlog("Failed to command active servo");
-			return;
+	// Hands the responses that have been written entirely over to the unacked queue.
+	for (u16_t i = 0U; i < nVectors && written > 0U; ++i) {
+		if (written < vectors[i].len) {
+			session->nBytesWritten += (uint32_t) written;
+			break;
 		}
 
-		osMemoryPoolFree(app->commandMemPoolId, threadState->command);
+		written -= vectors[i].len;
+		endSeqNo += (uint32_t) vectors[i].len;
 
-		if (!threadState->command->header.wrOnly) {
-			DX_ETH2USB_App_UsbThread_PutResponse(app);
-		}
+		response = DX_ETH2USB_App_EthThread_DequeueResponse(session);
+		session->nBytesWritten = 0U;
+
+		DX_ETH2USB_App_EthThread_RecordWritten(app, response);
+
+		// Without a PCB lwIP doesn't reference anything anymore.
+		if (pcb == NULL)
+			DX_ETH2USB_App_EthThread_FreeResponse(app, response);
+		else
+			DX_ETH2USB_App_EthThread_HoldResponseUntilAcked(session, response,
+					endSeqNo);
+	}
+
+	return true;
+}
+
+/// Applies a telemetry subscription of the session, the USB thread only answers it.
+static void DX_ETH2USB_App_EthThread_Subscribe(
+		DX_ETH2USB_App_EthThread_SessionState_t *session,
+		const DX_ETH2USB_App_Command_t *command) {
+	const uint8_t deviceNo = DX_ETH2USB_App_DeviceNo(command);
+
+	// The USB thread fails the command for a device that doesn't exist.
+	if (deviceNo >= DX_ETH2USB__USB__MAX_DEVICE_CNT)
+		return;
+
+	if (command->length > 0U && command->payload[0] != 0U)
+		session->telemetryMask |= (uint8_t) (1U << deviceNo);
+	else
+		session->telemetryMask &= (uint8_t) ~(1U << deviceNo);
+}
+
+static void DX_ETH2USB_App_EthThread_ReadCommand_HandleSuccess_ForwardToUSB(
+		DX_ETH2USB_AppState_t *app,
+		DX_ETH2USB_App_EthThread_SessionState_t *session) {
+	if (session->command->frame.header.type == DX__ETH2USB__COMMAND_TYPE__SUBSCRIBE)
+		DX_ETH2USB_App_EthThread_Subscribe(session, session->command);
+
+	session->command->origin.sessionNo = DX_ETH2USB_App_EthThread_SessionNo(
+			app, session);
+	session->command->origin.epoch = session->epoch;
+
+	// The slot is taken from now on, the USB thread allocates it once it gets to the command.
+	if (!(session->command->frame.header.flags & DX__ETH2USB__COMMAND_FLAG__WR_ONLY))
+		++session->nResponseSlots;
+
+	DX_ETH2USB_App_EthThread_PushCommand(app, session->command);
+
+	session->command = NULL;
+}
+
+static void DX_ETH2USB_App_EthThread_ReadCommand_HandleEndOfStream(
+		DX_ETH2USB_AppState_t *app,
+		DX_ETH2USB_App_EthThread_SessionState_t *session) {
+	mlog("Received end of stream while reading incoming command");
+
+	DX_ETH2USB_App_EthThread_ShutdownClientSocket(session);
+}
+
+static void DX_ETH2USB_App_EthThread_ReadCommand_HandleError(
+		DX_ETH2USB_AppState_t *app,
+		DX_ETH2USB_App_EthThread_SessionState_t *session, err_t err) {
+
+	if (err == ERR_WOULDBLOCK)
+		return;
+	else if (DX_ETH2USB_App_EthThread_IsConnectionLost(err)) {
+		mlog("Remote closed stream while reading incoming command, error: %d", err);
+		DX_ETH2USB_App_EthThread_CloseClientSocket(app, session);
+	} else {
+		mlog("Failed to read incoming command, error: %d", err);
+		Error_Handler();
+	}
+}
+
+static bool DX_ETH2USB_App_EthThread_StartReadingCommand(
+		DX_ETH2USB_AppState_t *app,
+		DX_ETH2USB_App_EthThread_SessionState_t *session) {
+	if (osMemoryPoolGetSpace(app->commandMemPoolId) == 0)
+		return false;
+
+	// Stops reading from a client that doesn't pick up its responses, instead of letting it
+	//  take the slots of the others.
+	if (session->nResponseSlots >= DX_ETH2USB__APP__MAX_SESSION_RESPONSE_CNT)
+		return false;
+
+	session->command = osMemoryPoolAlloc(app->commandMemPoolId, 0U);
+	if (session->command == NULL)
+		Error_Handler();
+
+	// Version 1 headers only fill in the flags.
+	memset(&session->command->frame.header, 0,
+			sizeof(DX_ETH2USB_CommandHeaderV2_t));
+
+	session->command->payload = session->command->frame.payload;
+
+	session->nBytesRead = 0;
+
+	return true;
+}
+
+/// Receives the next pbuf from the client connection if we've consumed the previous one.
+static bool DX_ETH2USB_App_EthThread_ReceivePbuf(
+		DX_ETH2USB_AppState_t *app,
+		DX_ETH2USB_App_EthThread_SessionState_t *session) {
+	err_t err = ERR_OK;
+
+	if (session->pbuf != NULL)
+		return true;
+
+	err = netconn_recv_tcp_pbuf(session->conn, &session->pbuf);
+
+	if (err == ERR_OK) {
+		session->pbufOffset = 0U;
+		return true;
+	}
+
+	session->pbuf = NULL;
+
+	if (err == ERR_CLSD)
+		DX_ETH2USB_App_EthThread_ReadCommand_HandleEndOfStream(app, session);
+	else
+		DX_ETH2USB_App_EthThread_ReadCommand_HandleError(app, session, err);
+
+	return false;
+}
+
+/// Skips n bytes of the received pbuf, and frees the pbuf once it has been consumed
+///  entirely.
+static void DX_ETH2USB_App_EthThread_ConsumePbuf(
+		DX_ETH2USB_App_EthThread_SessionState_t *session, uint16_t n) {
+	session->pbufOffset += n;
+
+	if (session->pbufOffset >= session->pbuf->tot_len) {
+		pbuf_free(session->pbuf);
+		session->pbuf = NULL;
+	}
+}
+
+/// Copies up to size bytes out of the received pbuf.
+static uint16_t DX_ETH2USB_App_EthThread_CopyFromPbuf(
+		DX_ETH2USB_App_EthThread_SessionState_t *session, void *dst,
+		uint32_t size) {
+	uint16_t n = 0U;
+
+	n = pbuf_copy_partial(session->pbuf, dst, (uint16_t) size,
+			session->pbufOffset);
+	DX_ETH2USB_App_EthThread_ConsumePbuf(session, n);
+
+	return n;
+}
+
+/// Gets the size of the command header on the wire for the version of the session.
+static uint32_t DX_ETH2USB_App_EthThread_CommandHeaderSize(
+		DX_ETH2USB_App_EthThread_SessionState_t *session) {
+	if (session->version == DX__ETH2USB__PROTOCOL_VERSION__1)
+		return sizeof(DX_ETH2USB_CommandHeader_t);
+
+	return sizeof(DX_ETH2USB_CommandHeaderV2_t);
+}
+
+/// Takes the lengths out of a just received command header, returns false if the
+///  command cannot be handled.
+static bool DX_ETH2USB_App_EthThread_ParseCommandHeader(
+		DX_ETH2USB_AppState_t *app,
+		DX_ETH2USB_App_EthThread_SessionState_t *session) {
+	DX_ETH2USB_App_Command_t *command = session->command;
+
+	// Version 1 commands always are a single packet each way, and go to the first device.
+	if (session->version == DX__ETH2USB__PROTOCOL_VERSION__1) {
+		command->frame.header.flags &= DX__ETH2USB__COMMAND_FLAG__WR_ONLY;
+		command->length = DX__ETH2USB__COMMAND__PAYLOAD_BUFFER_SIZE;
+		command->maxResponseLength = DX__ETH2USB__RESPONSE__PAYLOAD_BUFFER_SIZE;
+		return true;
+	}
+
+	command->length = lwip_ntohs(command->frame.header.length);
+	command->maxResponseLength = lwip_ntohs(
+			command->frame.header.maxResponseLength);
+
+	if (command->maxResponseLength == 0U)
+		command->maxResponseLength = DX_ETH2USB__MAX_PACKET_SIZE;
+
+	if (command->length > DX__ETH2USB__COMMAND_V2__PAYLOAD_BUFFER_SIZE
+			|| command->maxResponseLength
+					> DX__ETH2USB__RESPONSE_V2__PAYLOAD_BUFFER_SIZE) {
+		mlog("Session %u sent command with length %u and response length %u, "
+				"which exceeds %u", DX_ETH2USB_App_EthThread_SessionNo(app, session),
+				command->length, command->maxResponseLength,
+				DX_ETH2USB__MAX_TRANSFER_SIZE);
+		return false;
+	}
+
+	return true;
+}
+
+/// Copies as much as possible of the received data into the current command, so that
+///  the RX buffers go back to the Ethernet driver right away. Returns true if any progress
+///  has been made.
+static bool DX_ETH2USB_App_EthThread_ReadCommand(
+		DX_ETH2USB_AppState_t *app,
+		DX_ETH2USB_App_EthThread_SessionState_t *session) {
+	DX_ETH2USB_CommandV2_t *frame = &session->command->frame;
+	uint16_t n = 0U;
+
+	if (!DX_ETH2USB_App_EthThread_ReceivePbuf(app, session))
+		return session->conn == NULL;
+
+	const uint32_t headerSize = DX_ETH2USB_App_EthThread_CommandHeaderSize(
+			session);
+
+	// The header gets read first, since it holds the length of the payload.
+	if (session->nBytesRead < headerSize) {
+		n = DX_ETH2USB_App_EthThread_CopyFromPbuf(session,
+				&((uint8_t*) &frame->header)[session->nBytesRead],
+				headerSize - session->nBytesRead);
+		session->nBytesRead += n;
+
+		if (session->nBytesRead < headerSize)
+			return true;
+
+		if (!DX_ETH2USB_App_EthThread_ParseCommandHeader(app, session)) {
+			// There's no way to find the next frame in the stream.
+			DX_ETH2USB_App_EthThread_ShutdownClientSocket(session);
+			return true;
+		}
+	} else {
+		n = DX_ETH2USB_App_EthThread_CopyFromPbuf(session,
+				&frame->payload[session->nBytesRead - headerSize],
+				headerSize + session->command->length - session->nBytesRead);
+		session->nBytesRead += n;
+	}
+
+	if (session->nBytesRead < headerSize + session->command->length)
+		return true;
+
+	DX_ETH2USB_Latency_ClearStamps(&session->command->stamps);
+	DX_ETH2USB_Latency_Stamp(&session->command->stamps,
+			DX__ETH2USB__LATENCY__STAMP__RECEIVED);
+
+	mlog("Received entire command of size %u", session->nBytesRead);
+
+	DX_ETH2USB_App_EthThread_ReadCommand_HandleSuccess_ForwardToUSB(app,
+			session);
+
+	return true;
+}
+
+/// Reads the hello a session of the hello port starts with, and picks the protocol
+///  version from it. Returns true if any progress has been made.
+static bool DX_ETH2USB_App_EthThread_Negotiate(DX_ETH2USB_AppState_t *app,
+		DX_ETH2USB_App_EthThread_SessionState_t *session) {
+	DX_ETH2USB_Hello_t *hello = &session->hello;
+	uint16_t n = 0U;
+
+	if (!DX_ETH2USB_App_EthThread_ReceivePbuf(app, session))
+		return session->conn == NULL;
+
+	n = DX_ETH2USB_App_EthThread_CopyFromPbuf(session,
+			&((uint8_t*) hello)[session->nBytesRead],
+			sizeof(DX_ETH2USB_Hello_t) - session->nBytesRead);
+	session->nBytesRead += n;
+
+	if (session->nBytesRead < sizeof(DX_ETH2USB_Hello_t))
+		return true;
+
+	if (hello->magic != DX__ETH2USB__HELLO__MAGIC) {
+		mlog("Session %u did not start with a hello",
+				DX_ETH2USB_App_EthThread_SessionNo(app, session));
+
+		DX_ETH2USB_App_EthThread_ShutdownClientSocket(session);
+		return true;
+	}
+
+	// We speak the requested version, or the latest one we know if it's newer.
+	if (hello->version < DX__ETH2USB__PROTOCOL_VERSION__1)
+		hello->version = DX__ETH2USB__PROTOCOL_VERSION__1;
+	else if (hello->version > DX__ETH2USB__PROTOCOL_VERSION__LATEST)
+		hello->version = DX__ETH2USB__PROTOCOL_VERSION__LATEST;
+
+	mlog("Session %u negotiated version %u",
+			DX_ETH2USB_App_EthThread_SessionNo(app, session), hello->version);
+
+	session->version = hello->version;
+	session->nBytesRead = 0U;
+
+	// The hello gets sent back as the answer.
+	hello->credits = DX_ETH2USB_App_EthThread_Credits(app, session,
+			session->unackedQueue.count);
+	session->helloPending = true;
+	session->nBytesWritten = 0U;
+
+	return true;
+}
+
+/// Gets called from the TCP/IP thread on every event of one of our connections.
+static void DX_ETH2USB_App_EthThread_NetconnCallback(struct netconn *conn,
+		enum netconn_evt evt, u16_t len) {
+	DX_ETH2USB_AppState_t *app = DX_ETH2USB_App_Instance;
+
+	if (app == NULL || app->ethThreadId == NULL)
+		return;
+
+	osThreadFlagsSet(app->ethThreadId, DX_ETH2USB__APP__ETH_THREAD_FLAG__NETCONN);
+}
+
+/// Starts the given server socket of the Ethernet thread.
+static void DX_ETH2USB_App_EthThread_StartServerSocket(
+		DX_ETH2USB_App_EthThread_ServerState_t *server) {
+	err_t err = ERR_OK;
+
+	server->conn = netconn_new_with_callback(NETCONN_TCP,
+			DX_ETH2USB_App_EthThread_NetconnCallback);
+	if (server->conn == NULL) {
+		mlog("Failed to create server connection");
+		Error_Handler();
+	}
+
+	err = netconn_bind(server->conn, IP_ADDR_ANY, server->port);
+	if (err != ERR_OK) {
+		mlog("Failed to bind server connection, error: %d", err);
+		Error_Handler();
+	}
+
+	err = netconn_listen_with_backlog(server->conn,
+			DX_ETH2USB__APP__MAX_SESSION_CNT);
+	if (err != ERR_OK) {
+		mlog("Failed to listen server connection, error: %d", err);
+		Error_Handler();
+	}
+
+	netconn_set_nonblocking(server->conn, 1);
+}
+
+/// Finds a session that is not in use, or NULL if all of them are.
+static DX_ETH2USB_App_EthThread_SessionState_t* DX_ETH2USB_App_EthThread_FindFreeSession(
+		DX_ETH2USB_AppState_t *app) {
+	DX_ETH2USB_App_EthThreadState_t *threadState = &app->ethThreadState;
+
+	for (uint8_t i = 0U; i < DX_ETH2USB__APP__MAX_SESSION_CNT; ++i) {
+		if (threadState->sessions[i].conn == NULL)
+			return &threadState->sessions[i];
+	}
+
+	return NULL;
+}
+
+/// Starts the datagram socket for the Ethernet thread.
+static void DX_ETH2USB_App_EthThread_StartUdpSocket(
+		DX_ETH2USB_AppState_t *app) {
+	DX_ETH2USB_App_EthThread_UdpState_t *udp = &app->ethThreadState.udp;
+	err_t err = ERR_OK;
+
+	udp->conn = netconn_new_with_callback(NETCONN_UDP,
+			DX_ETH2USB_App_EthThread_NetconnCallback);
+	if (udp->conn == NULL) {
+		mlog("Failed to create datagram connection");
+		Error_Handler();
+	}
+
+	err = netconn_bind(udp->conn, IP_ADDR_ANY, udp->port);
+	if (err != ERR_OK) {
+		mlog("Failed to bind datagram connection, error: %d", err);
+		Error_Handler();
+	}
+
+	netconn_set_nonblocking(udp->conn, 1);
+}
+
+static bool DX_ETH2USB_App_EthThread_AcceptClientSocket(
+		DX_ETH2USB_AppState_t *app,
+		DX_ETH2USB_App_EthThread_ServerState_t *server) {
+	DX_ETH2USB_App_EthThreadState_t *threadState = &app->ethThreadState;
+	DX_ETH2USB_App_EthThread_SessionState_t *session = NULL;
+	struct netconn *conn = NULL;
+	ip_addr_t addr;
+	u16_t port = 0U;
+	err_t err = ERR_OK;
+
+	// Leaves the connection in the backlog until a session frees up.
+	session = DX_ETH2USB_App_EthThread_FindFreeSession(app);
+	if (session == NULL)
+		return false;
+
+	err = netconn_accept(server->conn, &conn);
+	if (err == ERR_WOULDBLOCK)
+		return false;
+	else if (err != ERR_OK) {
+		mlog("Failed to accept client connection, error: %d", err);
+		Error_Handler();
+	}
+
+	// Accepted connections inherit the callback, but not the blocking mode.
+	netconn_set_nonblocking(conn, 1);
+
+#ifdef DX_ETH2USB__APP__TCP_NODELAY
+	LOCK_TCPIP_CORE();
+	tcp_nagle_disable(conn->pcb.tcp);
+	UNLOCK_TCPIP_CORE();
+#endif
+
+	netconn_peer(conn, &addr, &port);
+	mlog("Accepted client connection %s:%u as session %u", ipaddr_ntoa(&addr),
+			port, DX_ETH2USB_App_EthThread_SessionNo(app, session));
+
+	DX_ETH2USB_App_Init_ThreadStates_EthThread_Session(session);
+	session->conn = conn;
+	session->version = server->version;
+
+	++threadState->nConnectedSessions;
+
+	return true;
+}
+
+/// Performs all the work of a single session that can be done without blocking,
+///  returns true if any progress has been made.
+static bool DX_ETH2USB_App_EthThread_PollSession(DX_ETH2USB_AppState_t *app,
+		DX_ETH2USB_App_EthThread_SessionState_t *session) {
+	bool progress = false;
+
+	progress |= DX_ETH2USB_App_EthThread_ReleaseAckedResponses(app, session);
+
+	// A client that only shut down its sending side still gets the responses to all the
+	//  commands it sent, the slots count both the queued and the outstanding ones.
+	if (session->closing) {
+		if (session->nResponseSlots == 0U) {
+			DX_ETH2USB_App_EthThread_CloseClientSocket(app, session);
+			return true;
+		}
+
+		if (session->helloPending)
+			progress |= DX_ETH2USB_App_EthThread_WriteHello(app, session);
+		else if (session->responseQueue.count > 0U)
+			progress |= DX_ETH2USB_App_EthThread_WriteResponses(app, session);
+
+		return progress;
+	}
+
+	if (session->version == 0U)
+		return DX_ETH2USB_App_EthThread_Negotiate(app, session) || progress;
+
+	if (session->helloPending) {
+		progress |= DX_ETH2USB_App_EthThread_WriteHello(app, session);
+	} else if (DX_ETH2USB_App_EthThread_ShouldFlush(session)) {
+		progress |= DX_ETH2USB_App_EthThread_WriteResponses(app, session);
+	}
+
+	if (session->conn == NULL)
+		return true;
+
+	if (session->command == NULL)
+		progress |= DX_ETH2USB_App_EthThread_StartReadingCommand(app, session);
+	if (session->command != NULL)
+		progress |= DX_ETH2USB_App_EthThread_ReadCommand(app, session);
+
+	return progress;
+}
+
+/// Gets how long the Ethernet thread may sleep without missing the coalescing timeout
+///  of a session.
+static uint32_t DX_ETH2USB_App_EthThread_WaitTimeout(
+		DX_ETH2USB_AppState_t *app) {
+#if DX_ETH2USB__APP__FLUSH_POLICY == DX_ETH2USB__APP__FLUSH_POLICY__COALESCE
+	DX_ETH2USB_App_EthThreadState_t *threadState = &app->ethThreadState;
+
+	// The tick is coarser than the coalescing timeout, so that's the shortest sleep.
+	for (uint8_t i = 0U; i < DX_ETH2USB__APP__MAX_SESSION_CNT; ++i) {
+		if (threadState->sessions[i].conn != NULL
+				&& threadState->sessions[i].responseQueue.count > 0U)
+			return 1U;
+	}
+#endif
+
+	return osWaitForever;
+}
+
+/// Performs all the work that can be done without blocking, returns true if any
+///  progress has been made.
+static bool DX_ETH2USB_App_EthThread_Poll(DX_ETH2USB_AppState_t *app) {
+	DX_ETH2USB_App_EthThreadState_t *threadState = &app->ethThreadState;
+	DX_ETH2USB_App_EthThread_SessionState_t *session = NULL;
+	bool progress = false;
+
+	progress |= DX_ETH2USB_App_EthThread_AcceptClientSocket(app,
+			&threadState->server);
+	progress |= DX_ETH2USB_App_EthThread_AcceptClientSocket(app,
+			&threadState->helloServer);
+	progress |= DX_ETH2USB_App_EthThread_Udp_ReceiveCommand(app);
+	progress |= DX_ETH2USB_App_EthThread_RouteResponses(app);
+	progress |= DX_ETH2USB_App_EthThread_PublishTelemetry(app);
+
+	for (uint8_t i = 0U; i < DX_ETH2USB__APP__MAX_SESSION_CNT; ++i) {
+		session = &threadState->sessions[i];
+
+		if (session->conn != NULL)
+			progress |= DX_ETH2USB_App_EthThread_PollSession(app, session);
+	}
+
+	return progress;
+}
+
+static void DX_ETH2USB_App_EthThread(void *arg) {
+	DX_ETH2USB_AppState_t *app = arg;
+
+	// Our identifier is needed by the netconn callback before osThreadNew() returns.
+	app->ethThreadId = osThreadGetId();
+
+	DX_ETH2USB_App_EthThread_StartServerSocket(&app->ethThreadState.server);
+	DX_ETH2USB_App_EthThread_StartServerSocket(&app->ethThreadState.helloServer);
+	DX_ETH2USB_App_EthThread_StartUdpSocket(app);
+
+	while (true) {
+		if (DX_ETH2USB_App_EthThread_Poll(app))
+			continue;
+
+		// Nothing can be done until either a connection, the USB thread or a servo has
+		//  news, or coalesced responses are due.
+		osThreadFlagsWait(
+				DX_ETH2USB__APP__ETH_THREAD_FLAG__NETCONN
+						| DX_ETH2USB__APP__ETH_THREAD_FLAG__USB
+						| DX_ETH2USB__APP__ETH_THREAD_FLAG__TELEMETRY, osFlagsWaitAny,
+				DX_ETH2USB_App_EthThread_WaitTimeout(app));
+	}
+}
+
+/// Takes the next command for the servo, returns NULL if there is none.
+static DX_ETH2USB_App_Command_t* DX_ETH2USB_App_UsbThread_GetCommand(
+		DX_ETH2USB_AppState_t *app) {
+	void *command = NULL;
+
+	if (!DX_ETH2USB_Ring_Pop(&app->commandRing, &command))
+		return NULL;
+
+	return command;
+}
+
+/// Whether any device is connected.
+static bool DX_ETH2USB_App_IsAnyDeviceConnected(void) {
+	for (uint8_t deviceNo = 0U; deviceNo < DX_ETH2USB__USB__MAX_DEVICE_CNT; ++deviceNo)
+		if (DX_USBH_IsDeviceConnected[deviceNo])
+			return true;
+
+	return false;
+}
+
+/// Drops the cached responses of the given device.
+static void DX_ETH2USB_App_UsbThread_Cache_Invalidate(DX_ETH2USB_AppState_t *app,
+		uint8_t deviceNo) {
+	DX_ETH2USB_App_UsbThread_Cache_t *cache = &app->usbThreadState.cache;
+
+	++app->usbThreadState.devices[deviceNo].cacheGeneration;
+
+	for (uint8_t i = 0U; i < DX_ETH2USB__APP__RESPONSE_CACHE_ENTRY_CNT; ++i)
+		if (cache->entries[i].deviceNo == deviceNo)
+			cache->entries[i].valid = false;
+
+	++cache->nInvalidations;
+}
+
+/// Drops the cached responses of the given device if it has been replaced since.
+static void DX_ETH2USB_App_UsbThread_Cache_Sync(DX_ETH2USB_AppState_t *app,
+		uint8_t deviceNo) {
+	DX_ETH2USB_App_UsbThread_DeviceState_t *device =
+			&app->usbThreadState.devices[deviceNo];
+	const uint32_t connectionNo = DX_USBH_ConnectionNo[deviceNo];
+
+	if (device->connectionNo == connectionNo)
+		return;
+
+	device->connectionNo = connectionNo;
+	DX_ETH2USB_App_UsbThread_Cache_Invalidate(app, deviceNo);
+}
+
+/// Whether the response to the given idempotent command fits in the cache.
+static bool DX_ETH2USB_App_UsbThread_Cache_IsCacheable(
+		const DX_ETH2USB_App_Command_t *command) {
+	return command->response != NULL
+			&& command->length <= DX_ETH2USB__MAX_PACKET_SIZE
+			&& command->maxResponseLength <= DX_ETH2USB__MAX_PACKET_SIZE;
+}
+
+/// Finds the entry that caches the response to the given command, NULL if there is none.
+static DX_ETH2USB_App_UsbThread_CacheEntry_t* DX_ETH2USB_App_UsbThread_Cache_Find(
+		DX_ETH2USB_AppState_t *app, const DX_ETH2USB_App_Command_t *command) {
+	DX_ETH2USB_App_UsbThread_Cache_t *cache = &app->usbThreadState.cache;
+	DX_ETH2USB_App_UsbThread_CacheEntry_t *entry = NULL;
+
+	for (uint8_t i = 0U; i < DX_ETH2USB__APP__RESPONSE_CACHE_ENTRY_CNT; ++i) {
+		entry = &cache->entries[i];
+
+		if (entry->valid && entry->deviceNo == DX_ETH2USB_App_DeviceNo(command)
+				&& entry->length == command->length
+				&& entry->maxResponseLength == command->maxResponseLength
+				&& memcmp(entry->command, command->payload, command->length) == 0)
+			return entry;
+	}
+
+	return NULL;
+}
+
+/// Answers the given servo command from the cache if it's idempotent and its response is
+///  there, returns false if it has to be sent to the servo. Any other command might change
+///  what the servo answers, so it drops the cached responses of its device.
+static bool DX_ETH2USB_App_UsbThread_Cache_Answer(DX_ETH2USB_AppState_t *app,
+		DX_ETH2USB_App_Command_t *command) {
+	const uint8_t deviceNo = DX_ETH2USB_App_DeviceNo(command);
+	DX_ETH2USB_App_UsbThread_Cache_t *cache = &app->usbThreadState.cache;
+	DX_ETH2USB_App_UsbThread_CacheEntry_t *entry = NULL;
+	DX_ETH2USB_App_Response_t *response = command->response;
+	const uint32_t now = osKernelGetTickCount();
+
+	DX_ETH2USB_App_UsbThread_Cache_Sync(app, deviceNo);
+
+	if (!(command->frame.header.flags & DX__ETH2USB__COMMAND_FLAG__IDEMPOTENT)) {
+		DX_ETH2USB_App_UsbThread_Cache_Invalidate(app, deviceNo);
+		return false;
+	}
+
+	if (!DX_ETH2USB_App_UsbThread_Cache_IsCacheable(command))
+		return false;
+
+	command->cacheGeneration = app->usbThreadState.devices[deviceNo].cacheGeneration;
+
+	entry = DX_ETH2USB_App_UsbThread_Cache_Find(app, command);
+	if (entry == NULL || (int32_t) (now - entry->expiryTick) >= 0) {
+		++cache->nMisses;
+		return false;
+	}
+
+	entry->lastUsedTick = now;
+
+	memcpy(response->frame.payload, entry->response, entry->responseLength);
+	response->frame.header.status = DX__ETH2USB__RESPONSE_STATUS__OK;
+	response->frame.header.length = lwip_htons(entry->responseLength);
+
+	++cache->nHits;
+
+	return true;
+}
+
+/// Caches the response to the given idempotent command once it completed, unless its
+///  device got sent something else since the command got started.
+static void DX_ETH2USB_App_UsbThread_Cache_Store(DX_ETH2USB_AppState_t *app,
+		const DX_ETH2USB_App_Command_t *command) {
+	const uint8_t deviceNo = DX_ETH2USB_App_DeviceNo(command);
+	DX_ETH2USB_App_UsbThread_Cache_t *cache = &app->usbThreadState.cache;
+	DX_ETH2USB_App_UsbThread_CacheEntry_t *entry = NULL;
+	const DX_ETH2USB_App_Response_t *response = command->response;
+	const uint32_t now = osKernelGetTickCount();
+
+	if (command->frame.header.type != DX__ETH2USB__COMMAND_TYPE__SERVO
+			|| !(command->frame.header.flags & DX__ETH2USB__COMMAND_FLAG__IDEMPOTENT)
+			|| !DX_ETH2USB_App_UsbThread_Cache_IsCacheable(command)
+			|| response->frame.header.status != DX__ETH2USB__RESPONSE_STATUS__OK)
+		return;
+
+	DX_ETH2USB_App_UsbThread_Cache_Sync(app, deviceNo);
+
+	if (command->cacheGeneration
+			!= app->usbThreadState.devices[deviceNo].cacheGeneration)
+		return;
+
+	// Replaces the response that was cached already, or else the least recently used one.
+	entry = DX_ETH2USB_App_UsbThread_Cache_Find(app, command);
+	if (entry == NULL) {
+		entry = &cache->entries[0];
+
+		for (uint8_t i = 1U; i < DX_ETH2USB__APP__RESPONSE_CACHE_ENTRY_CNT
+				&& entry->valid; ++i) {
+			if (!cache->entries[i].valid
+					|| (int32_t) (cache->entries[i].lastUsedTick - entry->lastUsedTick) < 0)
+				entry = &cache->entries[i];
+		}
+	}
+
+	entry->valid = true;
+	entry->deviceNo = deviceNo;
+	entry->length = command->length;
+	entry->maxResponseLength = command->maxResponseLength;
+	memcpy(entry->command, command->payload, command->length);
+
+	entry->expiryTick = now + DX_ETH2USB__APP__RESPONSE_CACHE_TTL_MS;
+	entry->lastUsedTick = now;
+
+	entry->responseLength = lwip_ntohs(response->frame.header.length);
+	memcpy(entry->response, response->frame.payload, entry->responseLength);
+}
+
+/// Answers with the counters of the response cache.
+static void DX_ETH2USB_App_UsbThread_HandleCacheStatsCommand(
+		DX_ETH2USB_AppState_t *app, DX_ETH2USB_App_Command_t *command) {
+	DX_ETH2USB_App_UsbThread_Cache_t *cache = &app->usbThreadState.cache;
+	DX_ETH2USB_App_Response_t *response = command->response;
+	DX_ETH2USB_CacheStats_t *stats = NULL;
+
+	if (response == NULL)
+		return;
+
+	stats = (DX_ETH2USB_CacheStats_t*) response->frame.payload;
+	stats->nHits = lwip_htonl(cache->nHits);
+	stats->nMisses = lwip_htonl(cache->nMisses);
+	stats->nInvalidations = lwip_htonl(cache->nInvalidations);
+
+	response->frame.header.length = lwip_htons(sizeof(DX_ETH2USB_CacheStats_t));
+}
+
+/// Answers with how long the device of the command took to come up when last plugged in.
+static void DX_ETH2USB_App_UsbThread_HandleAttachStatsCommand(
+		DX_ETH2USB_AppState_t *app, DX_ETH2USB_App_Command_t *command) {
+	const uint8_t deviceNo = DX_ETH2USB_App_DeviceNo(command);
+	const uint32_t connectionNo = DX_USBH_ConnectionNo[deviceNo];
+	DX_ETH2USB_App_UsbThread_DeviceState_t *device =
+			&app->usbThreadState.devices[deviceNo];
+	DX_ETH2USB_App_Response_t *response = command->response;
+	DX_ETH2USB_AttachStats_t *stats = NULL;
+
+	if (response == NULL)
+		return;
+
+	stats = (DX_ETH2USB_AttachStats_t*) response->frame.payload;
+	memset(stats, 0, sizeof(DX_ETH2USB_AttachStats_t));
+
+	stats->connectionNo = lwip_htonl(connectionNo);
+	stats->plugToReadyMs = lwip_htonl(DX_USBH_IsDeviceConnected[deviceNo] ?
+			DX_USBH_ReadyTick[deviceNo] - DX_USBH_PlugTick[deviceNo] :
+			DX__ETH2USB__ATTACH__NOT_YET);
+	stats->plugToFirstCommandMs = lwip_htonl(device->servedConnectionNo == connectionNo ?
+			device->plugToFirstCommandMs : DX__ETH2USB__ATTACH__NOT_YET);
+
+	response->frame.header.length = lwip_htons(sizeof(DX_ETH2USB_AttachStats_t));
+}
+
+/// Answers with the latency histogram of the stage in the first payload byte.
+static void DX_ETH2USB_App_UsbThread_HandleLatencyStatsCommand(
+		DX_ETH2USB_AppState_t *app, DX_ETH2USB_App_Command_t *command) {
+	DX_ETH2USB_App_Response_t *response = command->response;
+	const DX_ETH2USB_Latency_Histogram_t *histogram = NULL;
+	DX_ETH2USB_LatencyStats_t *stats = NULL;
+	uint8_t stage = 0U;
+
+	if (response == NULL)
+		return;
+
+	if (command->length < 1U || command->payload[0] >= DX__ETH2USB__LATENCY__STAGE_CNT) {
+		mlog("Received latency statistics command for unknown stage");
+		response->frame.header.status = DX__ETH2USB__RESPONSE_STATUS__ERR;
+		return;
+	}
+
+	stage = command->payload[0];
+	histogram = &app->latency.stages[stage];
+
+	stats = (DX_ETH2USB_LatencyStats_t*) response->frame.payload;
+	memset(stats, 0, sizeof(DX_ETH2USB_LatencyStats_t));
+
+	stats->stage = stage;
+	stats->subBucketBits = DX__ETH2USB__LATENCY__SUB_BUCKET_BITS;
+	stats->bucketCnt = DX__ETH2USB__LATENCY__BUCKET_CNT;
+	stats->nSamples = lwip_htonl(histogram->nSamples);
+	stats->maxMicros = lwip_htonl(histogram->maxMicros);
+
+	for (uint32_t i = 0U; i < DX__ETH2USB__LATENCY__BUCKET_CNT; ++i)
+		stats->buckets[i] = lwip_htonl(histogram->buckets[i]);
+
+	response->frame.header.length = lwip_htons(sizeof(DX_ETH2USB_LatencyStats_t));
+}
+
+/// Hands the response of the given command over to the Ethernet thread if there is
+///  one, and releases the command.
+static void DX_ETH2USB_App_UsbThread_FinishCommand(DX_ETH2USB_AppState_t *app,
+		DX_ETH2USB_App_Command_t *command) {
+	bool wake = false;
+
+	if (command->response != NULL)
+		DX_ETH2USB_Latency_Stamp(&command->stamps,
+				DX__ETH2USB__LATENCY__STAMP__RESPONSE_ENQUEUED);
+
+	// Everything from being enqueued up to the response, the Ethernet thread does the rest.
+	for (uint8_t stage = DX__ETH2USB__LATENCY__STAMP__ENQUEUED;
+			stage <= DX__ETH2USB__LATENCY__STAMP__RESPONSE_ENQUEUED; ++stage)
+		DX_ETH2USB_Latency_Record(&app->latency, &command->stamps, stage);
+
+	if (command->response != NULL) {
+		command->response->stamps = command->stamps;
+
+		// Cannot overflow, the ring is as large as the response pool.
+		if (!DX_ETH2USB_Ring_Push(&app->responseRing, command->response, &wake))
+			Error_Handler();
+
+		command->response = NULL;
+	}
+
+	DX_ETH2USB_App_FreeCommand(app, command);
+
+	// Wakes the Ethernet thread only if it might wait, for either a response or a free
+	//  command slot.
+	if (wake || osMemoryPoolGetSpace(app->commandMemPoolId) == 1U)
+		osThreadFlagsSet(app->ethThreadId, DX_ETH2USB__APP__ETH_THREAD_FLAG__USB);
+}
+
+/// Gets called from the USB host thread once a submitted servo command completed.
+static void DX_ETH2USB_App_UsbThread_HandleCompletion(void *arg,
+		const DX_ActiveServoClass_Rsp_TypeDef *rsp) {
+	DX_ETH2USB_App_Command_t *command = arg;
+	DX_ETH2USB_AppState_t *app = DX_ETH2USB_App_Instance;
+	osStatus_t status = osOK;
+
+	if (command->response != NULL) {
+		command->response->frame.header.status =
+				rsp->status == DX__ACTIVE_SERVO_CLASS__OK ?
+						DX__ETH2USB__RESPONSE_STATUS__OK :
+						DX__ETH2USB__RESPONSE_STATUS__ERR;
+		command->response->frame.header.length = lwip_htons(rsp->inLength);
+	}
+
+	command->stamps.at[DX__ETH2USB__LATENCY__STAMP__OUT_SUBMITTED] = rsp->outSubmittedTimestamp;
+	command->stamps.at[DX__ETH2USB__LATENCY__STAMP__OUT_DONE] = rsp->outDoneTimestamp;
+	command->stamps.at[DX__ETH2USB__LATENCY__STAMP__IN_DONE] = rsp->inDoneTimestamp;
+
+	// Cannot overflow, the queue is as large as the command pool.
+	status = osMessageQueuePut(app->completionMsgQueueId, &command, 0U, 0U);
+	if (status != osOK)
+		Error_Handler();
+
+	osThreadFlagsSet(app->usbThreadId,
+			DX_ETH2USB__APP__USB_THREAD_FLAG__COMPLETION);
+}
+
+/// Takes the time from the device being plugged in to the first command it served, write
+///  only commands count as served once they completed.
+static void DX_ETH2USB_App_UsbThread_MeasureAttach(DX_ETH2USB_AppState_t *app,
+		const DX_ETH2USB_App_Command_t *command) {
+	const uint8_t deviceNo = DX_ETH2USB_App_DeviceNo(command);
+	const uint32_t connectionNo = DX_USBH_ConnectionNo[deviceNo];
+	DX_ETH2USB_App_UsbThread_DeviceState_t *device =
+			&app->usbThreadState.devices[deviceNo];
+
+	if (device->servedConnectionNo == connectionNo)
+		return;
+
+	if (command->response != NULL
+			&& command->response->frame.header.status != DX__ETH2USB__RESPONSE_STATUS__OK)
+		return;
+
+	device->servedConnectionNo = connectionNo;
+	device->plugToFirstCommandMs = osKernelGetTickCount() - DX_USBH_PlugTick[deviceNo];
+
+	mlog("Device %u served its first command %lu ms after being plugged in", deviceNo,
+			device->plugToFirstCommandMs);
+}
+
+/// Finishes the commands that completed, returns true if there were any.
+static bool DX_ETH2USB_App_UsbThread_HandleCompletions(
+		DX_ETH2USB_AppState_t *app) {
+	DX_ETH2USB_App_UsbThreadState_t *threadState = &app->usbThreadState;
+	DX_ETH2USB_App_Command_t *command = NULL;
+	bool progress = false;
+
+	while (osMessageQueueGet(app->completionMsgQueueId, &command, NULL, 0U)
+			== osOK) {
+		--threadState->devices[DX_ETH2USB_App_DeviceNo(command)].nSubmitted;
+		DX_ETH2USB_App_UsbThread_MeasureAttach(app, command);
+		DX_ETH2USB_App_UsbThread_Cache_Store(app, command);
+		DX_ETH2USB_App_UsbThread_FinishCommand(app, command);
+
+		progress = true;
+	}
+
+	return progress;
+}
+
+/// Gets called from the USB host thread once a poll of the status table completed, the
+///  arg is the number of the entry.
+static void DX_ETH2USB_App_UsbThread_HandlePollCompletion(void *arg,
+		const DX_ActiveServoClass_Rsp_TypeDef *rsp) {
+	DX_ETH2USB_AppState_t *app = DX_ETH2USB_App_Instance;
+	DX_ETH2USB_App_PollCompletion_t completion;
+	osStatus_t status = osOK;
+
+	completion.entryNo = (uint8_t) (uintptr_t) arg;
+	completion.status =
+			rsp->status == DX__ACTIVE_SERVO_CLASS__OK ?
+					DX__ETH2USB__RESPONSE_STATUS__OK :
+					DX__ETH2USB__RESPONSE_STATUS__ERR;
+	completion.inLength = rsp->inLength;
+
+	// Cannot overflow, the queue has room for a poll of every entry.
+	status = osMessageQueuePut(app->pollCompletionMsgQueueId, &completion, 0U, 0U);
+	if (status != osOK)
+		Error_Handler();
+
+	osThreadFlagsSet(app->usbThreadId,
+			DX_ETH2USB__APP__USB_THREAD_FLAG__COMPLETION);
+}
+
+/// Stores the results of the polls that completed in the status table, returns true if
+///  there were any.
+static bool DX_ETH2USB_App_UsbThread_HandlePollCompletions(
+		DX_ETH2USB_AppState_t *app) {
+	DX_ETH2USB_App_UsbThreadState_t *threadState = &app->usbThreadState;
+	DX_ETH2USB_App_UsbThread_PollEntry_t *entry = NULL;
+	DX_ETH2USB_App_PollCompletion_t completion;
+	bool progress = false;
+
+	while (osMessageQueueGet(app->pollCompletionMsgQueueId, &completion, NULL, 0U)
+			== osOK) {
+		entry = &threadState->pollEntries[completion.entryNo];
+
+		entry->inFlight = false;
+		--threadState->devices[entry->submittedDeviceNo].nSubmitted;
+
+		progress = true;
+
+		// The entry got configured again while it was being polled.
+		if (entry->submittedGeneration != entry->generation)
+			continue;
+
+		memcpy(entry->result, entry->in, completion.inLength);
+		entry->resultLength = completion.inLength;
+		entry->status = completion.status;
+		entry->timestamp = osKernelGetTickCount();
+		++entry->nUpdates;
+	}
+
+	return progress;
+}
+
+/// Submits the polls of the status table that are due, returns true if any has been
+///  submitted.
+static bool DX_ETH2USB_App_UsbThread_StartPolls(DX_ETH2USB_AppState_t *app) {
+	DX_ETH2USB_App_UsbThreadState_t *threadState = &app->usbThreadState;
+	DX_ETH2USB_App_UsbThread_DeviceState_t *device = NULL;
+	DX_ETH2USB_App_UsbThread_PollEntry_t *entry = NULL;
+	DX_ActiveServoClass_Cmd_TypeDef cmd;
+	const uint32_t now = osKernelGetTickCount();
+	bool progress = false;
+
+	for (uint8_t entryNo = 0U; entryNo < DX_ETH2USB__APP__POLL_ENTRY_CNT; ++entryNo) {
+		entry = &threadState->pollEntries[entryNo];
+		device = &threadState->devices[entry->deviceNo];
+
+		if (entry->intervalMs == 0U || entry->inFlight
+				|| (int32_t) (now - entry->nextTick) < 0)
+			continue;
+
+		if (!DX_USBH_IsDeviceConnected[entry->deviceNo]
+				|| device->nSubmitted
+						>= DX_ETH2USB__ACTIVE_SERVO_CLASS__SUBMISSION_RING_SIZE)
+			continue;
+
+		// The command may get configured again while the servo still reads it.
+		memcpy(entry->out, entry->command, entry->length);
+
+		cmd.out = entry->out;
+		cmd.outLength = entry->length;
+		cmd.in = entry->in;
+		cmd.inLength = entry->maxResponseLength;
+		cmd.callback = DX_ETH2USB_App_UsbThread_HandlePollCompletion;
+		cmd.arg = (void*) (uintptr_t) entryNo;
+		cmd.timeout = 0U;
+
+		// Keeps the rate, but doesn't try to catch up on polls that got missed.
+		entry->nextTick += entry->intervalMs;
+		if ((int32_t) (now - entry->nextTick) >= 0)
+			entry->nextTick = now + entry->intervalMs;
+
+		if (DX_ActiveServoClass_Submit(DX_USBH_Hosts[entry->deviceNo], &cmd)
+				!= DX__ACTIVE_SERVO_CLASS__OK) {
+			mlog("Failed to submit poll %u to active servo %u", entryNo,
+					entry->deviceNo);
+			continue;
+		}
+
+		++device->nSubmitted;
+
+		entry->inFlight = true;
+		entry->submittedDeviceNo = entry->deviceNo;
+		entry->submittedGeneration = entry->generation;
+
+		progress = true;
+	}
+
+	return progress;
+}
+
+/// Configures an entry of the status table, its previous result is gone from then on.
+///  Returns false if the configuration is invalid.
+static bool DX_ETH2USB_App_UsbThread_ConfigurePoll(DX_ETH2USB_AppState_t *app,
+		const DX_ETH2USB_App_Command_t *command) {
+	const DX_ETH2USB_PollConfigHeader_t *config =
+			(const DX_ETH2USB_PollConfigHeader_t*) command->payload;
+	DX_ETH2USB_App_UsbThread_PollEntry_t *entry = NULL;
+	uint16_t length = 0U;
+	uint16_t maxResponseLength = 0U;
+
+	if (command->length < sizeof(DX_ETH2USB_PollConfigHeader_t)) {
+		mlog("Poll configuration command got truncated header");
+		return false;
+	}
+
+	length = command->length - sizeof(DX_ETH2USB_PollConfigHeader_t);
+	maxResponseLength = lwip_ntohs(config->maxResponseLength);
+	if (maxResponseLength == 0U)
+		maxResponseLength = DX_ETH2USB__MAX_PACKET_SIZE;
+
+	if (config->entryNo >= DX_ETH2USB__APP__POLL_ENTRY_CNT
+			|| length > DX__ETH2USB__POLL__MAX_COMMAND_SIZE
+			|| maxResponseLength > DX__ETH2USB__POLL__MAX_RESULT_SIZE) {
+		mlog("Poll configuration command for entry %u with length %u and response "
+				"length %u is out of range", config->entryNo, length, maxResponseLength);
+		return false;
+	}
+
+	entry = &app->usbThreadState.pollEntries[config->entryNo];
+
+	entry->deviceNo = DX_ETH2USB_App_DeviceNo(command);
+	entry->intervalMs = lwip_ntohs(config->intervalMs);
+	entry->length = length;
+	entry->maxResponseLength = maxResponseLength;
+	memcpy(entry->command, &command->payload[sizeof(DX_ETH2USB_PollConfigHeader_t)],
+			length);
+	++entry->generation;
+
+	entry->nextTick = osKernelGetTickCount();
+
+	entry->status = DX__ETH2USB__RESPONSE_STATUS__ERR;
+	entry->resultLength = 0U;
+	entry->timestamp = 0U;
+	entry->nUpdates = 0U;
+
+	return true;
+}
+
+/// Answers with the latest results of the entries of the status table the payload lists,
+///  without bothering the servo.
+static void DX_ETH2USB_App_UsbThread_HandlePollReadCommand(
+		DX_ETH2USB_AppState_t *app, DX_ETH2USB_App_Command_t *command) {
+	DX_ETH2USB_App_Response_t *response = command->response;
+	DX_ETH2USB_App_UsbThread_PollEntry_t *entry = NULL;
+	DX_ETH2USB_PollResultHeader_t *result = NULL;
+	uint8_t status = DX__ETH2USB__RESPONSE_STATUS__OK;
+	const uint32_t now = osKernelGetTickCount();
+	uint32_t responseOffset = 0U;
+
+	if (response == NULL)
+		return;
+
+	for (uint16_t i = 0U; i < command->length; ++i) {
+		if (command->payload[i] >= DX_ETH2USB__APP__POLL_ENTRY_CNT) {
+			mlog("Poll read command for unknown entry %u", command->payload[i]);
+			status = DX__ETH2USB__RESPONSE_STATUS__ERR;
+			break;
+		}
+
+		entry = &app->usbThreadState.pollEntries[command->payload[i]];
+
+		if (responseOffset + sizeof(DX_ETH2USB_PollResultHeader_t)
+				+ entry->resultLength > sizeof(response->frame.payload)) {
+			mlog("Poll read command results don't fit in a single response");
+			status = DX__ETH2USB__RESPONSE_STATUS__ERR;
+			break;
+		}
+
+		result = (DX_ETH2USB_PollResultHeader_t*) &response->frame.payload[responseOffset];
+		result->status = entry->status;
+		result->reserved = 0U;
+		result->length = lwip_htons(entry->resultLength);
+		result->timestamp = lwip_htonl(entry->timestamp);
+		result->age = lwip_htonl(now - entry->timestamp);
+		result->nUpdates = lwip_htonl(entry->nUpdates);
+		responseOffset += sizeof(DX_ETH2USB_PollResultHeader_t);
+
+		memcpy(&response->frame.payload[responseOffset], entry->result,
+				entry->resultLength);
+		responseOffset += entry->resultLength;
+	}
+
+	response->frame.header.status = status;
+	response->frame.header.length = lwip_htons((uint16_t) responseOffset);
+}
+
+/// Sends a single command to the servo, and reads its response if in is set.
+static uint8_t DX_ETH2USB_App_UsbThread_Transact(uint8_t deviceNo, uint8_t *out,
+		uint16_t outLength, uint8_t *in, uint16_t maxInLength,
+		uint16_t *inLength) {
+	DX_ActiveServoClass_StatusTypeDef status = DX__ACTIVE_SERVO_CLASS__OK;
+
+	*inLength = 0U;
+
+	status = DX_ActiveServoClass_Cmd(DX_USBH_Hosts[deviceNo], out, outLength, in,
+			maxInLength, inLength);
+	if (status != DX__ACTIVE_SERVO_CLASS__OK) {
+		mlog("Failed to command active servo");
+		return DX__ETH2USB__RESPONSE_STATUS__ERR;
+	}
+
+	return DX__ETH2USB__RESPONSE_STATUS__OK;
+}
+
+/// Submits a plain servo command, it gets finished once it completed. Returns false if
+///  it could not be submitted.
+static bool DX_ETH2USB_App_UsbThread_SubmitServoCommand(
+		DX_ETH2USB_AppState_t *app, DX_ETH2USB_App_Command_t *command) {
+	const uint8_t deviceNo = DX_ETH2USB_App_DeviceNo(command);
+	DX_ETH2USB_App_UsbThreadState_t *threadState = &app->usbThreadState;
+	DX_ETH2USB_App_Response_t *response = command->response;
+	DX_ActiveServoClass_Cmd_TypeDef cmd;
+
+	cmd.out = command->payload;
+	cmd.outLength = command->length;
+	cmd.in = response != NULL ? response->frame.payload : NULL;
+	cmd.inLength = command->maxResponseLength;
+	cmd.callback = DX_ETH2USB_App_UsbThread_HandleCompletion;
+	cmd.arg = command;
+	cmd.timeout = 0U;
+
+	if (DX_ActiveServoClass_Submit(DX_USBH_Hosts[deviceNo], &cmd)
+			!= DX__ACTIVE_SERVO_CLASS__OK) {
+		mlog("Failed to submit command to active servo %u", deviceNo);
+		return false;
+	}
+
+	++threadState->devices[deviceNo].nSubmitted;
+
+	return true;
+}
+
+/// Executes the sub-commands of a batch command back to back, and aggregates their
+///  responses. A write only batch doesn't read anything for any of its sub-commands.
+static void DX_ETH2USB_App_UsbThread_HandleBatchCommand(
+		DX_ETH2USB_AppState_t *app, DX_ETH2USB_App_Command_t *command) {
+	DX_ETH2USB_App_Response_t *response = command->response;
+	DX_ETH2USB_SubCommandHeader_t *subCommand = NULL;
+	DX_ETH2USB_SubResponseHeader_t *subResponse = NULL;
+	uint8_t status = DX__ETH2USB__RESPONSE_STATUS__OK;
+	uint32_t offset = 0U;
+	uint32_t responseOffset = 0U;
+	uint16_t length = 0U;
+	uint16_t maxResponseLength = 0U;
+	uint16_t inLength = 0U;
+	uint8_t *in = NULL;
+
+	while (offset < command->length) {
+		if (command->length - offset < sizeof(DX_ETH2USB_SubCommandHeader_t)) {
+			mlog("Batch command got truncated sub-command header");
+			status = DX__ETH2USB__RESPONSE_STATUS__ERR;
+			break;
+		}
+
+		subCommand = (DX_ETH2USB_SubCommandHeader_t*) &command->payload[offset];
+		offset += sizeof(DX_ETH2USB_SubCommandHeader_t);
+
+		length = lwip_ntohs(subCommand->length);
+		maxResponseLength = lwip_ntohs(subCommand->maxResponseLength);
+		if (maxResponseLength == 0U)
+			maxResponseLength = DX_ETH2USB__MAX_PACKET_SIZE;
+
+		if (length > command->length - offset) {
+			mlog("Batch command got truncated sub-command payload");
+			status = DX__ETH2USB__RESPONSE_STATUS__ERR;
+			break;
+		}
+
+		in = NULL;
+		subResponse = NULL;
+
+		if (response != NULL) {
+			if (responseOffset + sizeof(DX_ETH2USB_SubResponseHeader_t)
+					+ maxResponseLength > sizeof(response->frame.payload)) {
+				mlog("Batch command responses don't fit in a single response");
+				status = DX__ETH2USB__RESPONSE_STATUS__ERR;
+				break;
+			}
+
+			subResponse =
+					(DX_ETH2USB_SubResponseHeader_t*) &response->frame.payload[responseOffset];
+			responseOffset += sizeof(DX_ETH2USB_SubResponseHeader_t);
+
+			if (!(subCommand->flags & DX__ETH2USB__COMMAND_FLAG__WR_ONLY))
+				in = &response->frame.payload[responseOffset];
+		}
+
+		status = DX_ETH2USB_App_UsbThread_Transact(
+				DX_ETH2USB_App_DeviceNo(command),
+				&command->payload[offset], length, in, maxResponseLength,
+				&inLength);
+		offset += length;
+
+		if (subResponse != NULL) {
+			subResponse->flags = 0U;
+			subResponse->status = status;
+			subResponse->length = lwip_htons(inLength);
+			responseOffset += inLength;
+		}
+
+		if (status != DX__ETH2USB__RESPONSE_STATUS__OK)
+			break;
+	}
+
+	if (response != NULL) {
+		response->frame.header.status = status;
+		response->frame.header.length = lwip_htons((uint16_t) responseOffset);
+	}
+}
+
+/// Starts the execution of the given command. Servo commands complete asynchronously,
+///  everything else gets finished right away.
+static void DX_ETH2USB_App_UsbThread_StartCommand(DX_ETH2USB_AppState_t *app,
+		DX_ETH2USB_App_Command_t *command) {
+	const DX_ETH2USB_CommandHeaderV2_t *header = &command->frame.header;
+	DX_ETH2USB_App_Response_t *response = NULL;
+
+	// Nobody is waiting for the outcome anymore, so the servo doesn't get bothered.
+	if (DX_ETH2USB_App_IsStale(app, &command->origin)) {
+		mlog("Cancelling stale command of session %u", command->origin.sessionNo);
+
+		command->response = NULL;
+		DX_ETH2USB_App_UsbThread_FinishCommand(app, command);
+		return;
+	}
+
+	command->response = NULL;
+
+	if (!(header->flags & DX__ETH2USB__COMMAND_FLAG__WR_ONLY)) {
+		// Slots stay taken until the client acknowledged their responses. Sessions can't
+		//  take them all, so the wait ends once a datagram response got sent at the latest.
+		response = osMemoryPoolAlloc(app->responseMemPoolId, osWaitForever);
+		if (response == NULL)
+			Error_Handler();
+
+		response->origin = command->origin;
+
+		memset(&response->frame.header, 0, sizeof(DX_ETH2USB_ResponseHeaderV2_t));
+		response->frame.header.requestId = header->requestId;
+
+		command->response = response;
+	}
+
+	if (DX_ETH2USB_App_DeviceNo(command) >= DX_ETH2USB__USB__MAX_DEVICE_CNT) {
+		mlog("Received command for unknown device %u",
+				DX_ETH2USB_App_DeviceNo(command));
+
+		if (response != NULL)
+			response->frame.header.status = DX__ETH2USB__RESPONSE_STATUS__ERR;
+
+		DX_ETH2USB_App_UsbThread_FinishCommand(app, command);
+		return;
+	}
+
+	switch (header->type) {
+	case DX__ETH2USB__COMMAND_TYPE__SERVO:
+		if (DX_ETH2USB_App_UsbThread_Cache_Answer(app, command))
+			break;
+
+		if (DX_ETH2USB_App_UsbThread_SubmitServoCommand(app, command))
+			return;
+
+		if (response != NULL)
+			response->frame.header.status = DX__ETH2USB__RESPONSE_STATUS__ERR;
+
+		break;
+	case DX__ETH2USB__COMMAND_TYPE__BATCH:
+		DX_ETH2USB_App_UsbThread_Cache_Invalidate(app,
+				DX_ETH2USB_App_DeviceNo(command));
+		DX_ETH2USB_App_UsbThread_HandleBatchCommand(app, command);
+		break;
+	case DX__ETH2USB__COMMAND_TYPE__SUBSCRIBE:
+		// Applied by the Ethernet thread already.
+		break;
+	case DX__ETH2USB__COMMAND_TYPE__POLL_CONFIGURE:
+		if (!DX_ETH2USB_App_UsbThread_ConfigurePoll(app, command) && response != NULL)
+			response->frame.header.status = DX__ETH2USB__RESPONSE_STATUS__ERR;
+
+		break;
+	case DX__ETH2USB__COMMAND_TYPE__POLL_READ:
+		DX_ETH2USB_App_UsbThread_HandlePollReadCommand(app, command);
+		break;
+	case DX__ETH2USB__COMMAND_TYPE__CACHE_STATS:
+		DX_ETH2USB_App_UsbThread_HandleCacheStatsCommand(app, command);
+		break;
+	case DX__ETH2USB__COMMAND_TYPE__ATTACH_STATS:
+		DX_ETH2USB_App_UsbThread_HandleAttachStatsCommand(app, command);
+		break;
+	case DX__ETH2USB__COMMAND_TYPE__LATENCY_STATS:
+		DX_ETH2USB_App_UsbThread_HandleLatencyStatsCommand(app, command);
+		break;
+	default:
+		mlog("Received command of unknown type %u", header->type);
+
+		if (response != NULL)
+			response->frame.header.status = DX__ETH2USB__RESPONSE_STATUS__ERR;
+
+		break;
+	}
+
+	DX_ETH2USB_App_UsbThread_FinishCommand(app, command);
+}
+
+/// Whether the given command talks to the servo, the others are answered by the gateway.
+static bool DX_ETH2USB_App_UsbThread_NeedsDevice(
+		const DX_ETH2USB_App_Command_t *command) {
+	return command->frame.header.type == DX__ETH2USB__COMMAND_TYPE__SERVO
+			|| command->frame.header.type == DX__ETH2USB__COMMAND_TYPE__BATCH;
+}
+
+/// Sorts the queued commands by device, so a busy or absent servo doesn't hold up the
+///  others. Commands for devices that don't exist get failed right away. Returns true
+///  if any command has been taken.
+static bool DX_ETH2USB_App_UsbThread_SortCommands(DX_ETH2USB_AppState_t *app) {
+	DX_ETH2USB_App_UsbThreadState_t *threadState = &app->usbThreadState;
+	DX_ETH2USB_App_UsbThread_DeviceState_t *device = NULL;
+	DX_ETH2USB_App_Command_t *command = NULL;
+	uint8_t deviceNo = 0U;
+	bool progress = false;
+
+	while ((command = DX_ETH2USB_App_UsbThread_GetCommand(app)) != NULL) {
+		progress = true;
+
+		// Commands that don't involve the servo don't wait for it either.
+		deviceNo = DX_ETH2USB_App_DeviceNo(command);
+		if (deviceNo >= DX_ETH2USB__USB__MAX_DEVICE_CNT
+				|| !DX_ETH2USB_App_UsbThread_NeedsDevice(command)) {
+			DX_ETH2USB_App_UsbThread_StartCommand(app, command);
+			continue;
+		}
+
+		// Cannot overflow, there are no more commands than the pool holds.
+		device = &threadState->devices[deviceNo];
+		device->pending[(device->head + device->count)
+				% DX_ETH2USB__APP__COMMAND_MEM_POOL_SIZE] = command;
+		++device->count;
+	}
+
+	return progress;
+}
+
+/// Starts as many commands of every connected device as its submission ring can take,
+///  returns true if any command has been started.
+static bool DX_ETH2USB_App_UsbThread_StartCommands(DX_ETH2USB_AppState_t *app) {
+	DX_ETH2USB_App_UsbThreadState_t *threadState = &app->usbThreadState;
+	DX_ETH2USB_App_UsbThread_DeviceState_t *device = NULL;
+	DX_ETH2USB_App_Command_t *command = NULL;
+	bool progress = false;
+
+	for (uint8_t deviceNo = 0U; deviceNo < DX_ETH2USB__USB__MAX_DEVICE_CNT; ++deviceNo) {
+		device = &threadState->devices[deviceNo];
+
+		if (!DX_USBH_IsDeviceConnected[deviceNo])
+			continue;
+
+		while (device->count > 0U
+				&& device->nSubmitted
+						< DX_ETH2USB__ACTIVE_SERVO_CLASS__SUBMISSION_RING_SIZE) {
+			command = device->pending[device->head];
+			device->head = (device->head + 1U) % DX_ETH2USB__APP__COMMAND_MEM_POOL_SIZE;
+			--device->count;
+
+			DX_ETH2USB_App_UsbThread_StartCommand(app, command);
+
+			progress = true;
+		}
+	}
+
+	return progress;
+}
+
+/// Whether any command waits for a device that isn't connected.
+static bool DX_ETH2USB_App_UsbThread_IsAnyCommandBlocked(DX_ETH2USB_AppState_t *app) {
+	DX_ETH2USB_App_UsbThreadState_t *threadState = &app->usbThreadState;
+
+	for (uint8_t deviceNo = 0U; deviceNo < DX_ETH2USB__USB__MAX_DEVICE_CNT; ++deviceNo)
+		if (threadState->devices[deviceNo].count > 0U
+				&& !DX_USBH_IsDeviceConnected[deviceNo])
+			return true;
+
+	return false;
+}
+
+/// Gets how long the USB thread may sleep without missing a poll of the status table, or
+///  a device showing up that work waits for. Polls that wait for room in a submission ring
+///  get woken up by a completion.
+static uint32_t DX_ETH2USB_App_UsbThread_WaitTimeout(DX_ETH2USB_AppState_t *app) {
+	DX_ETH2USB_App_UsbThreadState_t *threadState = &app->usbThreadState;
+	DX_ETH2USB_App_UsbThread_PollEntry_t *entry = NULL;
+	const uint32_t now = osKernelGetTickCount();
+	uint32_t timeout = osWaitForever;
+	uint32_t remaining = 0U;
+
+	if (DX_ETH2USB_App_UsbThread_IsAnyCommandBlocked(app))
+		timeout = DX_ETH2USB__APP__DEVICE_RECHECK_INTERVAL_MS;
+
+	for (uint8_t entryNo = 0U; entryNo < DX_ETH2USB__APP__POLL_ENTRY_CNT; ++entryNo) {
+		entry = &threadState->pollEntries[entryNo];
+
+		if (entry->intervalMs == 0U || entry->inFlight)
+			continue;
+
+		if (!DX_USBH_IsDeviceConnected[entry->deviceNo])
+			remaining = DX_ETH2USB__APP__DEVICE_RECHECK_INTERVAL_MS;
+		else if (threadState->devices[entry->deviceNo].nSubmitted
+				>= DX_ETH2USB__ACTIVE_SERVO_CLASS__SUBMISSION_RING_SIZE)
+			continue;
+		else if ((int32_t) (entry->nextTick - now) > 0)
+			remaining = entry->nextTick - now;
+		else
+			remaining = 0U;
+
+		if (remaining < timeout)
+			timeout = remaining;
+	}
+
+	return timeout;
+}
+
+static void DX_ETH2USB_App_UsbThread(void *arg) {
+	DX_ETH2USB_AppState_t *app = arg;
+	bool progress = false;
+
+	// Our identifier is needed by the completion callback and the Ethernet thread.
+	app->usbThreadId = osThreadGetId();
+
+	while (true) {
+		// Commands that were in flight when a device got removed complete as failed.
+		progress = DX_ETH2USB_App_UsbThread_HandleCompletions(app);
+		progress |= DX_ETH2USB_App_UsbThread_HandlePollCompletions(app);
+		progress |= DX_ETH2USB_App_UsbThread_SortCommands(app);
+		progress |= DX_ETH2USB_App_UsbThread_StartPolls(app);
+		progress |= DX_ETH2USB_App_UsbThread_StartCommands(app);
+
+		if (progress)
+			continue;
 
-		osDelay(1);
+		// Nothing can be done until either a command arrives, one completes, a device gets
+		//  ready or a poll is due, commands for a device that isn't connected get checked on
+		//  every now and then too.
+		osThreadFlagsWait(
+				DX_ETH2USB__APP__USB_THREAD_FLAG__COMMAND
+						| DX_ETH2USB__APP__USB_THREAD_FLAG__COMPLETION
+						| DX_ETH2USB__APP__USB_THREAD_FLAG__DEVICE,
+				osFlagsWaitAny, DX_ETH2USB_App_UsbThread_WaitTimeout(app));
 	}
 }
 
@@ -486,7 +2599,7 @@ static void DX_ETH2USB_App_StatusThread_UpdateEthStatus(
 	DX_ETH2USB_App_StatusThreadState_t *state = &app->statusThreadState;
 	uint32_t currentTick = HAL_GetTick();
 
-	const bool isEthConnected = app->ethThreadState.client.connected;
+	const bool isEthConnected = app->ethThreadState.nConnectedSessions > 0U;
 
 	if (!isEthConnected && state->wasEthConnected) {
 		HAL_GPIO_WritePin(LED_YELLOW_GPIO_Port, LED_YELLOW_Pin, GPIO_PIN_RESET);
@@ -512,7 +2625,7 @@ static void DX_ETH2USB_App_StatusThread_UpdateUsbStatus(
 	DX_ETH2USB_App_StatusThreadState_t *state = &app->statusThreadState;
 	uint32_t currentTick = HAL_GetTick();
 
-	const bool isUsbConnected = DX_USBH_IsDeviceConnected;
+	const bool isUsbConnected = DX_ETH2USB_App_IsAnyDeviceConnected();
 
 	if (!isUsbConnected && state->wasUsbConnected) {
 		HAL_GPIO_WritePin(LED_GREEN_GPIO_Port, LED_GREEN_Pin, GPIO_PIN_RESET);
@@ -0,0 +1,61 @@
+/*
+ * latency.c
+ *
+ *  Created on: Oct 17, 2026
+ */
+
+#include "dx/eth2usb/latency.h"
+#include "dx/eth2usb/timestamp.h"
+
+/// Gets the bucket of the given duration.
+static uint32_t DX_ETH2USB_Latency_Bucket(uint32_t micros) {
+	uint32_t exponent = 0U;
+
+	if (micros < DX__ETH2USB__LATENCY__SUB_BUCKET_CNT)
+		return micros;
+
+	exponent = 31U - (uint32_t) __builtin_clz(micros);
+	if (exponent > DX__ETH2USB__LATENCY__MAX_EXPONENT)
+		return DX__ETH2USB__LATENCY__BUCKET_CNT - 1U;
+
+	return (exponent - DX__ETH2USB__LATENCY__SUB_BUCKET_BITS + 1U)
+			* DX__ETH2USB__LATENCY__SUB_BUCKET_CNT
+			+ ((micros >> (exponent - DX__ETH2USB__LATENCY__SUB_BUCKET_BITS))
+					& (DX__ETH2USB__LATENCY__SUB_BUCKET_CNT - 1U));
+}
+
+void DX_ETH2USB_Latency_ClearStamps(DX_ETH2USB_Latency_Stamps_t *stamps) {
+	for (uint32_t i = 0U; i < DX__ETH2USB__LATENCY__STAMP_CNT; ++i)
+		stamps->at[i] = DX__ETH2USB__TIMESTAMP__NONE;
+}
+
+void DX_ETH2USB_Latency_Stamp(DX_ETH2USB_Latency_Stamps_t *stamps, uint8_t stampNo) {
+	stamps->at[stampNo] = DX_ETH2USB_Timestamp_Now();
+}
+
+void DX_ETH2USB_Latency_Record(DX_ETH2USB_Latency_t *latency,
+		const DX_ETH2USB_Latency_Stamps_t *stamps, uint8_t stage) {
+	DX_ETH2USB_Latency_Histogram_t *histogram = &latency->stages[stage];
+	uint32_t start = 0U;
+	uint32_t end = 0U;
+	uint32_t micros = 0U;
+
+	if (stage == DX__ETH2USB__LATENCY__STAGE__ROUND_TRIP) {
+		start = stamps->at[DX__ETH2USB__LATENCY__STAMP__RECEIVED];
+		end = stamps->at[DX__ETH2USB__LATENCY__STAMP__RESPONSE_WRITTEN];
+	} else {
+		start = stamps->at[stage - 1U];
+		end = stamps->at[stage];
+	}
+
+	if (start == DX__ETH2USB__TIMESTAMP__NONE || end == DX__ETH2USB__TIMESTAMP__NONE)
+		return;
+
+	micros = DX_ETH2USB_Timestamp_ToMicros(end - start);
+
+	++histogram->nSamples;
+	++histogram->buckets[DX_ETH2USB_Latency_Bucket(micros)];
+
+	if (micros > histogram->maxMicros)
+		histogram->maxMicros = micros;
+}
@@ -0,0 +1,53 @@
+/*
+ * ring.c
+ *
+ *  Created on: Oct 17, 2026
+ */
+
+#include "dx/eth2usb/ring.h"
+#include "main.h"
+
+void DX_ETH2USB_Ring_Init(DX_ETH2USB_Ring_t *ring, void **slots, uint32_t slotCnt) {
+	ring->slots = slots;
+	ring->slotCnt = slotCnt;
+	ring->head = 0U;
+	ring->tail = 0U;
+}
+
+bool DX_ETH2USB_Ring_Push(DX_ETH2USB_Ring_t *ring, void *item, bool *wasEmpty) {
+	const uint32_t tail = ring->tail;
+	const uint32_t nextTail = (tail + 1U) % ring->slotCnt;
+
+	if (nextTail == ring->head)
+		return false;
+
+	ring->slots[tail] = item;
+
+	// The slot must be written before the consumer can see it.
+	__DMB();
+	ring->tail = nextTail;
+	__DMB();
+
+	// Read after publishing, a consumer that found the ring empty before has moved the
+	//  head up to the old tail by now, one that didn't yet will still find the pointer.
+	*wasEmpty = ring->head == tail;
+
+	return true;
+}
+
+bool DX_ETH2USB_Ring_Pop(DX_ETH2USB_Ring_t *ring, void **item) {
+	const uint32_t head = ring->head;
+
+	if (head == ring->tail)
+		return false;
+
+	// The slot must not be read before the tail that published it.
+	__DMB();
+	*item = ring->slots[head];
+
+	// And it must be read before the producer can reuse it.
+	__DMB();
+	ring->head = (head + 1U) % ring->slotCnt;
+
+	return true;
+}
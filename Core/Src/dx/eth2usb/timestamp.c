@@ -0,0 +1,24 @@
+/*
+ * timestamp.c
+ *
+ *  Created on: Oct 17, 2026
+ */
+
+#include "dx/eth2usb/timestamp.h"
+#include "main.h"
+
+void DX_ETH2USB_Timestamp_Init(void) {
+	CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+	// The DWT of the Cortex-M7 ignores writes until it got unlocked.
+	DWT->LAR = 0xC5ACCE55U;
+	DWT->CYCCNT = 0U;
+	DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+}
+
+uint32_t DX_ETH2USB_Timestamp_Now(void) {
+	return DWT->CYCCNT | 1U;
+}
+
+uint32_t DX_ETH2USB_Timestamp_ToMicros(uint32_t cycles) {
+	return cycles / (SystemCoreClock / 1000000U);
+}
@@ -57,7 +57,8 @@ const osThreadAttr_t defaultTask_attributes = {
   .priority = (osPriority_t) osPriorityNormal,
 };
 /* USER CODE BEGIN PV */
-DX_ETH2USB_AppState_t g_app_state;
+DX_ETH2USB_AppState_t g_app_state __attribute__((section(".DtcmSection")));
+extern uint8_t _susb_dma[];		/* Start of the USB DMA window, see the linker script. */
 /* USER CODE END PV */
 
 /* Private function prototypes -----------------------------------------------*/
@@ -101,6 +102,30 @@ int __io_putchar(int value) {
 
 	return value;
 }
+
+/// Makes the USB DMA window non-cacheable, its address comes from the linker script
+///  so the region can't be part of the generated MPU configuration.
+static void DX_ETH2USB_MPU_Config_UsbDma(void) {
+	MPU_Region_InitTypeDef MPU_InitStruct = {0};
+
+	HAL_MPU_Disable();
+
+	MPU_InitStruct.Enable = MPU_REGION_ENABLE;
+	MPU_InitStruct.Number = MPU_REGION_NUMBER3;
+	MPU_InitStruct.BaseAddress = (uint32_t) _susb_dma;
+	MPU_InitStruct.Size = MPU_REGION_SIZE_8KB;
+	MPU_InitStruct.SubRegionDisable = 0x0;
+	MPU_InitStruct.TypeExtField = MPU_TEX_LEVEL1;
+	MPU_InitStruct.AccessPermission = MPU_REGION_FULL_ACCESS;
+	MPU_InitStruct.DisableExec = MPU_INSTRUCTION_ACCESS_DISABLE;
+	MPU_InitStruct.IsShareable = MPU_ACCESS_NOT_SHAREABLE;
+	MPU_InitStruct.IsCacheable = MPU_ACCESS_NOT_CACHEABLE;
+	MPU_InitStruct.IsBufferable = MPU_ACCESS_NOT_BUFFERABLE;
+
+	HAL_MPU_ConfigRegion(&MPU_InitStruct);
+
+	HAL_MPU_Enable(MPU_PRIVILEGED_DEFAULT);
+}
 /* USER CODE END 0 */
 
 /**
@@ -127,6 +152,7 @@ int main(void)
   MPU_Config();
 
   /* USER CODE BEGIN Init */
+  DX_ETH2USB_MPU_Config_UsbDma();
   /* USER CODE END Init */
 
   /* Configure the system clock */
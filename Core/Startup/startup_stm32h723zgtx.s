@@ -43,6 +43,21 @@ defined in linker script */
 .word  _sbss
 /* end address for the .bss section. defined in linker script */
 .word  _ebss
+/* start address for the .dtcm_bss section. defined in linker script */
+.word  _sdtcm_bss
+/* end address for the .dtcm_bss section. defined in linker script */
+.word  _edtcm_bss
+/* start address for the USB DMA window. defined in linker script */
+.word  _susb_dma
+/* end address for the USB DMA window. defined in linker script */
+.word  _eusb_dma
+/* start address for the initialization values of the .itcm_text section.
+defined in linker script */
+.word  _sitcm_text
+/* start address for the .itcm_text section. defined in linker script */
+.word  _sitcm
+/* end address for the .itcm_text section. defined in linker script */
+.word  _eitcm
 /* stack used for SystemInit_ExtMemCtl; always internal RAM used */
 
 /**
@@ -79,6 +94,22 @@ LoopCopyDataInit:
   adds r4, r0, r3
   cmp r4, r1
   bcc CopyDataInit
+/* Copy the itcm_text segment from flash to ITCM */
+  ldr r0, =_sitcm
+  ldr r1, =_eitcm
+  ldr r2, =_sitcm_text
+  movs r3, #0
+  b LoopCopyItcmInit
+
+CopyItcmInit:
+  ldr r4, [r2, r3]
+  str r4, [r0, r3]
+  adds r3, r3, #4
+
+LoopCopyItcmInit:
+  adds r4, r0, r3
+  cmp r4, r1
+  bcc CopyItcmInit
 /* Zero fill the bss segment. */
   ldr r2, =_sbss
   ldr r4, =_ebss
@@ -93,6 +124,34 @@ LoopFillZerobss:
   cmp r2, r4
   bcc FillZerobss
 
+/* Zero fill the dtcm_bss segment. */
+  ldr r2, =_sdtcm_bss
+  ldr r4, =_edtcm_bss
+  movs r3, #0
+  b LoopFillZeroDtcmBss
+
+FillZeroDtcmBss:
+  str  r3, [r2]
+  adds r2, r2, #4
+
+LoopFillZeroDtcmBss:
+  cmp r2, r4
+  bcc FillZeroDtcmBss
+
+/* Zero fill the USB DMA window, which isn't part of .bss with every linker script. */
+  ldr r2, =_susb_dma
+  ldr r4, =_eusb_dma
+  movs r3, #0
+  b LoopFillZeroUsbDma
+
+FillZeroUsbDma:
+  str  r3, [r2]
+  adds r2, r2, #4
+
+LoopFillZeroUsbDma:
+  cmp r2, r4
+  bcc FillZeroUsbDma
+
 /* Call static constructors */
     bl __libc_init_array
 /* Call the application's entry point.*/
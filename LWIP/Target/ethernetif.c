@@ -175,7 +175,7 @@ lan8742_IOCtx_t  LAN8742_IOCtx = {ETH_PHY_IO_Init,
                                   ETH_PHY_IO_GetTick};
 
 /* USER CODE BEGIN 3 */
-
+static err_t low_level_output(struct netif *netif, struct pbuf *p);
 /* USER CODE END 3 */
 
 /* Private functions ---------------------------------------------------------*/
@@ -213,7 +213,28 @@ void HAL_ETH_ErrorCallback(ETH_HandleTypeDef *handlerEth)
 }
 
 /* USER CODE BEGIN 4 */
+/**
+ * DX_ETH2USB: responses are written without copying, so a segment that carries
+ * several of them chains more pbufs than there are Tx descriptors. Those get
+ * flattened into a single pbuf, everything else is passed through.
+ */
+static err_t low_level_output_flat(struct netif *netif, struct pbuf *p)
+{
+  struct pbuf *flat = NULL;
+  err_t errval = ERR_OK;
+
+  if (pbuf_clen(p) <= ETH_TX_DESC_CNT)
+    return low_level_output(netif, p);
 
+  flat = pbuf_clone(PBUF_RAW, PBUF_RAM, p);
+  if (flat == NULL)
+    return ERR_MEM;
+
+  errval = low_level_output(netif, flat);
+  pbuf_free(flat);
+
+  return errval;
+}
 /* USER CODE END 4 */
 
 /*******************************************************************************
@@ -374,7 +395,7 @@ static void low_level_init(struct netif *netif)
 #endif /* LWIP_ARP || LWIP_ETHERNET */
 
 /* USER CODE BEGIN LOW_LEVEL_INIT */
-
+  netif->linkoutput = low_level_output_flat;
 /* USER CODE END LOW_LEVEL_INIT */
 }
 
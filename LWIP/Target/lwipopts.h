@@ -122,6 +122,19 @@
 #define LWIP_ERRNO_STDINCLUDE
 #define LWIPERF_CHECK_RX_DATA 1
 
+/* DX_ETH2USB: a netconn for each of the two listeners and one netconn and PCB
+ * for each session (see DX_ETH2USB__APP__MAX_SESSION_CNT in settings.h), one more netconn for
+ * the datagram socket, and a netbuf for every queued datagram plus one to send.
+ */
+#define MEMP_NUM_NETCONN 8
+#define MEMP_NUM_TCP_PCB 8
+#define MEMP_NUM_NETBUF 8
+
+/* DX_ETH2USB: responses are written without copying, so every queued TCP segment of
+ * every session references them through a PBUF_ROM until it got acknowledged.
+ */
+#define MEMP_NUM_PBUF (4 * TCP_SND_QUEUELEN)
+
 /* ETH_CODE: macro and prototypes for proper (hopefuly?)
  * multithreading support
  */
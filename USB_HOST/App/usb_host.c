@@ -36,7 +36,18 @@
 /* USER CODE END Includes */
 
 /* USER CODE BEGIN PV */
-bool DX_USBH_IsDeviceConnected = false;
+/// Set once the class of the device is active, so that it can take commands.
+bool DX_USBH_IsDeviceConnected[DX_ETH2USB__USB__MAX_DEVICE_CNT] = { false };
+/// Advanced whenever a device connects, so that what is known about the device that was
+///  there before can be told apart.
+volatile uint32_t DX_USBH_ConnectionNo[DX_ETH2USB__USB__MAX_DEVICE_CNT] = { 0U };
+/// The kernel ticks at which the device last got plugged in, once the USB host library
+///  debounced and reset its port, and at which it could take commands after that.
+volatile uint32_t DX_USBH_PlugTick[DX_ETH2USB__USB__MAX_DEVICE_CNT] = { 0U };
+volatile uint32_t DX_USBH_ReadyTick[DX_ETH2USB__USB__MAX_DEVICE_CNT] = { 0U };
+/// The setup packets and descriptors in the handle get moved by the OTG DMA, the generated
+///  definition below takes the section of this declaration.
+extern USBH_HandleTypeDef hUsbHostHS __attribute__((section(".UsbDmaSection"), aligned(32)));
 /* USER CODE END PV */
 
 /* USER CODE BEGIN PFP */
@@ -52,6 +63,12 @@ ApplicationTypeDef Appli_state = APPLICATION_IDLE;
  * -- Insert your variables declaration here --
  */
 /* USER CODE BEGIN 0 */
+#if DX_ETH2USB__USB__MAX_DEVICE_CNT > 1 && !defined(USB2_OTG_FS)
+#error "Only one USB host port exists, the USB_FS pins belong to USB_OTG_HS"
+#endif
+
+/// The host every device is attached to, indexed by device number.
+USBH_HandleTypeDef *DX_USBH_Hosts[DX_ETH2USB__USB__MAX_DEVICE_CNT] = { &hUsbHostHS };
 /* USER CODE END 0 */
 
 /*
@@ -64,28 +81,56 @@ static void USBH_UserProcess(USBH_HandleTypeDef *phost, uint8_t id);
  */
 /* USER CODE BEGIN 1 */
 
+/// Gets the number of the device attached to the given host.
+static uint8_t USBH_UserProcess_DeviceNo(USBH_HandleTypeDef *phost) {
+	uint8_t deviceNo = 0U;
+
+	while (deviceNo < DX_ETH2USB__USB__MAX_DEVICE_CNT - 1U
+			&& DX_USBH_Hosts[deviceNo] != phost)
+		++deviceNo;
+
+	return deviceNo;
+}
+
 /// Handles the moment when an USB device gets disconnected.
 static void USBH_UserProcess_HandleDisconnect(USBH_HandleTypeDef *phost) {
-	mlog("USB Device got disconnected");
+	const uint8_t deviceNo = USBH_UserProcess_DeviceNo(phost);
+
+	mlog("USB Device %u got disconnected", deviceNo);
 
-	if (!DX_USBH_IsDeviceConnected)
+	if (!DX_USBH_IsDeviceConnected[deviceNo])
 		return;
 
 //	USBH_UserProcess_HandleClose_ClosePipes(phost);
 
-	DX_USBH_IsDeviceConnected = false;
+	DX_USBH_IsDeviceConnected[deviceNo] = false;
 }
 
-/// Gets called once a new USB device has connected.
+/// Gets called once a new USB device has connected, it still has to be enumerated.
 static void USBH_UserProcess_HandleConnect(USBH_HandleTypeDef *phost) {
-	mlog("USB Device got connected");
+	const uint8_t deviceNo = USBH_UserProcess_DeviceNo(phost);
 
-	if (DX_USBH_IsDeviceConnected)
+	mlog("USB Device %u got connected", deviceNo);
+
+	if (DX_USBH_IsDeviceConnected[deviceNo])
 		return;
 
-	DX_USBH_IsDeviceConnected = true;
+	DX_USBH_PlugTick[deviceNo] = osKernelGetTickCount();
+	++DX_USBH_ConnectionNo[deviceNo];
+}
+
+/// Gets called once the class of a connected USB device is active, before that commands
+///  for it would only fail.
+static void USBH_UserProcess_HandleClassActive(USBH_HandleTypeDef *phost) {
+	const uint8_t deviceNo = USBH_UserProcess_DeviceNo(phost);
 
+	DX_USBH_ReadyTick[deviceNo] = osKernelGetTickCount();
+	DX_USBH_IsDeviceConnected[deviceNo] = true;
+
+	mlog("USB Device %u is ready %lu ms after being plugged in", deviceNo,
+			DX_USBH_ReadyTick[deviceNo] - DX_USBH_PlugTick[deviceNo]);
 }
+
 /* USER CODE END 1 */
 
 /**
@@ -102,7 +147,7 @@ void MX_USB_HOST_Init(void)
   {
     Error_Handler();
   }
-  if (USBH_RegisterClass(&hUsbHostHS, DX_ACTIVE_SERVO_CLASS) != USBH_OK) {
+  if (USBH_RegisterClass(&hUsbHostHS, DX_ACTIVE_SERVO_CLASS(0U)) != USBH_OK) {
 	  Error_Handler();
   }
   if (USBH_Start(&hUsbHostHS) != USBH_OK)
@@ -134,6 +179,7 @@ static void USBH_UserProcess  (USBH_HandleTypeDef *phost, uint8_t id)
 
 	case HOST_USER_CLASS_ACTIVE:
 		Appli_state = APPLICATION_READY;
+		USBH_UserProcess_HandleClassActive(phost);
 
 		break;
 